@@ -0,0 +1,431 @@
+// Load generator for the FTP server: many concurrent sessions run a mix of
+// RETR, STOR, LIST and CWD for a while, then the throughput and latency
+// percentiles of every operation are printed. The protocol code is the
+// one of the client.
+#define FTP_CLIENT_NO_MAIN
+#include "client.c"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/resource.h>
+
+// Directory created below the area for the test files
+#define BENCH_DIR "bench"
+#define MAX_SIZES 16
+// Each session runs on its own thread; the transfer buffers of the client
+// live on its stack
+#define SESSION_STACK_SIZE (512 * 1024)
+// Same layout as the histograms of the server: 8 linear buckets per power
+// of two
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef enum { OP_RETR, OP_STOR, OP_LIST, OP_CWD, NUM_OPS } Operation;
+
+const char *op_names[NUM_OPS] = {"RETR", "STOR", "LIST", "CWD"};
+
+// Per session, merged once all sessions stopped
+typedef struct {
+     uint32_t latency[NUM_OPS][HIST_BUCKETS];  // nanoseconds
+     uint64_t latency_max[NUM_OPS];
+     long long count[NUM_OPS];
+     long long errors[NUM_OPS];
+     long long bytes[NUM_OPS];
+} Stats;
+
+typedef struct {
+     int id;
+     unsigned seed;
+     bool connected;
+     Stats stats;
+} BenchSession;
+
+// Settings, see usage()
+const char *server_ip = "127.0.0.1";
+const char *area = "public";
+int num_sessions = 100;
+int duration = 10;
+int op_weights[NUM_OPS] = {60, 20, 10, 10};
+long long sizes[MAX_SIZES] = {4 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+int size_weights[MAX_SIZES] = {50, 40, 10};
+int num_sizes = 3;
+
+atomic_bool stopping = false;
+char *upload_data;  // as large as the largest size
+
+uint64_t now_ns() {
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+unsigned histogram_bucket(uint64_t value) {
+     if (value < HIST_SUB_BUCKETS) return (unsigned)value;
+     int exponent = 63 - __builtin_clzll(value);
+     int shift = exponent - HIST_SUB_BITS;
+     return (unsigned)(shift + 1) * HIST_SUB_BUCKETS +
+            (unsigned)((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls into the bucket
+uint64_t histogram_bucket_limit(unsigned bucket) {
+     if (bucket < HIST_SUB_BUCKETS) return bucket;
+     unsigned shift = bucket / HIST_SUB_BUCKETS - 1;
+     uint64_t base = HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS;
+     return ((base + 1) << shift) - 1;
+}
+
+uint64_t histogram_quantile(const uint64_t *buckets, long long count,
+                            uint64_t max, double quantile) {
+     long long rank = (long long)(quantile * (double)count + 0.5);
+     if (rank == 0) rank = 1;
+     long long seen = 0;
+     for (unsigned i = 0; i < HIST_BUCKETS && count > 0; i++) {
+          seen += (long long)buckets[i];
+          if (seen >= rank) {
+               uint64_t limit = histogram_bucket_limit(i);
+               return limit < max ? limit : max;
+          }
+     }
+     return max;
+}
+
+// "12", "4k", "1m" or "2g"
+long long parse_size(const char *text) {
+     char *end;
+     long long size = strtoll(text, &end, 10);
+     if (end == text || size < 0) return -1;
+     const char *units = "kmg";
+     for (int i = 0; i < 3; i++) {
+          if (tolower((unsigned char)*end) == units[i]) {
+               size <<= 10 * (i + 1);
+               end++;
+               break;
+          }
+     }
+     return *end == '\0' ? size : -1;
+}
+
+// retr=60,stor=20,list=10,cwd=10
+bool parse_mix(char *text) {
+     int weights[NUM_OPS] = {0};
+     char *save_ptr;
+     for (char *item = strtok_r(text, ",", &save_ptr); item != NULL;
+          item = strtok_r(NULL, ",", &save_ptr)) {
+          char *value = strchr(item, '=');
+          if (value == NULL) return false;
+          *value++ = '\0';
+          int op = 0;
+          while (op < NUM_OPS && strcasecmp(item, op_names[op]) != 0) op++;
+          if (op == NUM_OPS || atoi(value) < 0) return false;
+          weights[op] = atoi(value);
+     }
+     memcpy(op_weights, weights, sizeof(weights));
+     return true;
+}
+
+// 4k=50,1m=40,16m=10
+bool parse_sizes(char *text) {
+     num_sizes = 0;
+     char *save_ptr;
+     for (char *item = strtok_r(text, ",", &save_ptr); item != NULL;
+          item = strtok_r(NULL, ",", &save_ptr)) {
+          char *value = strchr(item, '=');
+          if (value != NULL) *value++ = '\0';
+          if (num_sizes == MAX_SIZES) return false;
+          sizes[num_sizes] = parse_size(item);
+          size_weights[num_sizes] = value != NULL ? atoi(value) : 1;
+          if (sizes[num_sizes] < 0 || size_weights[num_sizes] < 0) {
+               return false;
+          }
+          num_sizes++;
+     }
+     return num_sizes > 0;
+}
+
+int pick(const int *weights, int count, unsigned *seed) {
+     int total = 0;
+     for (int i = 0; i < count; i++) total += weights[i];
+     int roll = total > 0 ? rand_r(seed) % total : 0;
+     for (int i = 0; i < count; i++) {
+          if (roll < weights[i]) return i;
+          roll -= weights[i];
+     }
+     return 0;
+}
+
+// A logged-in control connection in the test directory, -1 on failure
+int open_bench_session() {
+     char buffer[BUFFER_SIZE];
+     int sock = connect_to_server(server_ip);
+     if (sock < 0) return -1;
+
+     bool ok = receive_full_response(sock, buffer, BUFFER_SIZE) > 0;
+     if (ok && login_user[0] != '\0') {
+          snprintf(buffer, sizeof(buffer), "USER %.1000s", login_user);
+          ok = send_simple_command(sock, buffer, "331");
+          snprintf(buffer, sizeof(buffer), "PASS %.1000s", login_pass);
+          ok = ok && send_simple_command(sock, buffer, "230");
+     }
+     snprintf(buffer, sizeof(buffer), "CWD %.900s/" BENCH_DIR, area);
+     if (!ok || !send_simple_command(sock, buffer, "250")) {
+          close(sock);
+          return -1;
+     }
+     return sock;
+}
+
+// Returns the bytes moved, -1 if the operation failed
+long long run_operation(int sock, Operation op, int session_id,
+                        unsigned *seed) {
+     char reply[BUFFER_SIZE];
+     char filename[64];
+     char data_ip[INET_ADDRSTRLEN];
+     int data_port;
+     int size_index = pick(size_weights, num_sizes, seed);
+
+     if (op == OP_CWD) {
+          return send_simple_command(sock, "CWD ../" BENCH_DIR, "250") ? 0
+                                                                       : -1;
+     }
+     if (!enter_passive_mode(sock, reply, data_ip, &data_port)) return -1;
+
+     if (op == OP_RETR) {
+          snprintf(filename, sizeof(filename), "file_%d.bin", size_index);
+          long long received = retrieve_file(sock, filename, data_ip,
+                                             data_port, NULL, false, reply);
+          return received == sizes[size_index] ? received : -1;
+     }
+     if (op == OP_STOR) {
+          snprintf(filename, sizeof(filename), "upload_%d.bin", session_id);
+          FILE *file = fmemopen(upload_data, (size_t)sizes[size_index], "r");
+          if (file == NULL) return -1;
+          long long sent =
+              store_file(sock, filename, data_ip, data_port, file, reply);
+          fclose(file);
+          return sent == sizes[size_index] ? sent : -1;
+     }
+     return list_directory(sock, "LIST", data_ip, data_port, NULL, reply);
+}
+
+void *run_session(void *arg) {
+     BenchSession *session = arg;
+     Stats *stats = &session->stats;
+     int sock = -1;
+
+     while (!atomic_load(&stopping)) {
+          if (sock < 0) {
+               sock = open_bench_session();
+               if (sock < 0) {
+                    // The server may be out of descriptors, try again
+                    usleep(100 * 1000);
+                    continue;
+               }
+               session->connected = true;
+          }
+
+          Operation op = pick(op_weights, NUM_OPS, &session->seed);
+          uint64_t started = now_ns();
+          long long bytes =
+              run_operation(sock, op, session->id, &session->seed);
+          uint64_t elapsed = now_ns() - started;
+
+          if (bytes < 0) {
+               // The reply stream may be out of step, start over
+               stats->errors[op]++;
+               close(sock);
+               sock = -1;
+               continue;
+          }
+          stats->count[op]++;
+          stats->bytes[op] += bytes;
+          stats->latency[op][histogram_bucket(elapsed)]++;
+          if (elapsed > stats->latency_max[op]) {
+               stats->latency_max[op] = elapsed;
+          }
+     }
+
+     if (sock >= 0) {
+          send_simple_command(sock, "QUIT", "221");
+          close(sock);
+     }
+     return NULL;
+}
+
+// Uploads the files RETR downloads, unless they are already there
+bool prepare_files() {
+     char buffer[BUFFER_SIZE];
+     int sock = connect_to_server(server_ip);
+     if (sock < 0) return false;
+     receive_full_response(sock, buffer, BUFFER_SIZE);
+     if (login_user[0] != '\0') {
+          snprintf(buffer, sizeof(buffer), "USER %.1000s", login_user);
+          send_simple_command(sock, buffer, "331");
+          snprintf(buffer, sizeof(buffer), "PASS %.1000s", login_pass);
+          send_simple_command(sock, buffer, "230");
+     }
+     snprintf(buffer, sizeof(buffer), "CWD %.1000s", area);
+     bool ok = send_simple_command(sock, buffer, "250");
+     // Fails if the directory exists, which is fine
+     send_simple_command(sock, "MKD " BENCH_DIR, "257");
+     ok = ok && send_simple_command(sock, "CWD " BENCH_DIR, "250");
+
+     for (int i = 0; ok && i < num_sizes; i++) {
+          char filename[64];
+          char data_ip[INET_ADDRSTRLEN];
+          int data_port;
+          snprintf(filename, sizeof(filename), "file_%d.bin", i);
+          if (query_remote_size(sock, filename) == sizes[i]) continue;
+
+          FILE *file = fmemopen(upload_data, (size_t)sizes[i], "r");
+          ok = file != NULL &&
+               enter_passive_mode(sock, buffer, data_ip, &data_port) &&
+               store_file(sock, filename, data_ip, data_port, file, buffer) ==
+                   sizes[i];
+          if (file != NULL) fclose(file);
+     }
+     if (!ok) printf("Could not set up %s/%s: %s\n", area, BENCH_DIR, buffer);
+
+     send_simple_command(sock, "QUIT", "221");
+     close(sock);
+     return ok;
+}
+
+void print_report(BenchSession *sessions, double seconds) {
+     static uint64_t buckets[NUM_OPS][HIST_BUCKETS];
+     Stats total = {0};
+     int connected = 0;
+
+     for (int i = 0; i < num_sessions; i++) {
+          Stats *stats = &sessions[i].stats;
+          connected += sessions[i].connected;
+          for (int op = 0; op < NUM_OPS; op++) {
+               total.count[op] += stats->count[op];
+               total.errors[op] += stats->errors[op];
+               total.bytes[op] += stats->bytes[op];
+               if (stats->latency_max[op] > total.latency_max[op]) {
+                    total.latency_max[op] = stats->latency_max[op];
+               }
+               for (int b = 0; b < HIST_BUCKETS; b++) {
+                    buckets[op][b] += stats->latency[op][b];
+               }
+          }
+     }
+
+     printf("%d sessions (%d connected) for %.1f s against %s\n",
+            num_sessions, connected, seconds, server_ip);
+     printf("%-5s %10s %8s %10s %9s %9s %9s %9s %9s\n", "op", "count",
+            "errors", "ops/s", "MB/s", "p50 ms", "p99 ms", "p999 ms",
+            "max ms");
+     for (int op = 0; op < NUM_OPS; op++) {
+          if (op_weights[op] == 0) continue;
+          long long count = total.count[op];
+          uint64_t max = total.latency_max[op];
+          printf("%-5s %10lld %8lld %10.1f %9.1f %9.3f %9.3f %9.3f %9.3f\n",
+                 op_names[op], count, total.errors[op],
+                 (double)count / seconds,
+                 (double)total.bytes[op] / (1024 * 1024) / seconds,
+                 histogram_quantile(buckets[op], count, max, 0.5) / 1e6,
+                 histogram_quantile(buckets[op], count, max, 0.99) / 1e6,
+                 histogram_quantile(buckets[op], count, max, 0.999) / 1e6,
+                 max / 1e6);
+     }
+}
+
+void usage(const char *program) {
+     fprintf(stderr,
+             "Usage: %s [-c sessions] [-t seconds] [-m mix] [-s sizes]\n"
+             "          [-d area] [-u user -p password] [IP_ADDRESS]\n"
+             "  -m  weights of the operations, default "
+             "retr=60,stor=20,list=10,cwd=10\n"
+             "  -s  file sizes with their weights, default "
+             "4k=50,1m=40,16m=10\n",
+             program);
+}
+
+int main(int argc, char *argv[]) {
+     int option;
+     while ((option = getopt(argc, argv, "c:t:m:s:d:u:p:")) != -1) {
+          bool ok = true;
+          switch (option) {
+               case 'c':
+                    ok = (num_sessions = atoi(optarg)) > 0;
+                    break;
+               case 't':
+                    ok = (duration = atoi(optarg)) > 0;
+                    break;
+               case 'm':
+                    ok = parse_mix(optarg);
+                    break;
+               case 's':
+                    ok = parse_sizes(optarg);
+                    break;
+               case 'd':
+                    area = optarg;
+                    break;
+               case 'u':
+                    snprintf(login_user, sizeof(login_user), "%s", optarg);
+                    break;
+               case 'p':
+                    snprintf(login_pass, sizeof(login_pass), "%s", optarg);
+                    break;
+               default:
+                    ok = false;
+                    break;
+          }
+          if (!ok) {
+               usage(argv[0]);
+               return EXIT_FAILURE;
+          }
+     }
+     if (optind < argc) server_ip = argv[optind];
+
+     // Two descriptors per session, as many as the system allows
+     struct rlimit limit;
+     if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+          limit.rlim_cur = limit.rlim_max;
+          setrlimit(RLIMIT_NOFILE, &limit);
+     }
+
+     long long largest = 0;
+     for (int i = 0; i < num_sizes; i++) {
+          if (sizes[i] > largest) largest = sizes[i];
+     }
+     upload_data = malloc((size_t)largest + 1);
+     BenchSession *sessions = calloc((size_t)num_sessions, sizeof(*sessions));
+     pthread_t *threads = calloc((size_t)num_sessions, sizeof(*threads));
+     if (upload_data == NULL || sessions == NULL || threads == NULL) {
+          perror("Out of memory");
+          return EXIT_FAILURE;
+     }
+     for (long long i = 0; i < largest; i++) upload_data[i] = (char)(i % 251);
+
+     if (!prepare_files()) return EXIT_FAILURE;
+
+     pthread_attr_t attr;
+     pthread_attr_init(&attr);
+     pthread_attr_setstacksize(&attr, SESSION_STACK_SIZE);
+     uint64_t started = now_ns();
+     int running = 0;
+     for (; running < num_sessions; running++) {
+          sessions[running].id = running;
+          sessions[running].seed = (unsigned)(started + (uint64_t)running);
+          if (pthread_create(&threads[running], &attr, run_session,
+                             &sessions[running]) != 0) {
+               perror("Failed to start session thread");
+               break;
+          }
+     }
+     num_sessions = running;
+
+     sleep((unsigned)duration);
+     atomic_store(&stopping, true);
+     for (int i = 0; i < num_sessions; i++) pthread_join(threads[i], NULL);
+
+     print_report(sessions, (double)(now_ns() - started) / 1e9);
+     return 0;
+}
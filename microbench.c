@@ -0,0 +1,327 @@
+// Microbenchmarks of the per-command CPU work of the server: reading and
+// splitting command lines, dispatch, path resolution and reply formatting.
+// Every case runs until it has taken long enough to time and reports the
+// nanoseconds and heap allocations per operation.
+#define FTP_SERVER_NO_MAIN
+#include "server.c"
+
+#include <ftw.h>
+
+// Every case runs for at least this long once its iteration count is found
+#define BENCH_MIN_NS 200000000ull
+// Depth of the directory tree the path cases walk
+#define TREE_DEPTH 32
+
+// Heap allocations of the whole process, counted by wrapping the allocator
+// of the C library
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+_Atomic unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+     atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+     return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+     atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+     return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+     atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+     return __libc_realloc(ptr, size);
+}
+
+// Command lines as a client sends them during a typical session
+const char *corpus[] = {
+    "USER user1",        "PASS password1",     "CWD public",
+    "PWD",               "TYPE I",             "PASV",
+    "SIZE big.bin",      "REST 1048576",       "RETR big.bin",
+    "PASV",              "ALLO 4194304",       "STOR upload_17.bin",
+    "PASV",              "MLSD",               "MLST big.bin",
+    "RANG 0 1048575",    "PASV",               "RETR big.bin",
+    "CWD d1/d2/d3",      "NOOP",               "MKD new_directory",
+    "RMD new_directory", "PASV",               "LIST",
+    "CWD ..",            "SITE STATS",         "XCRC big.bin",
+    "QUIT",
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+Session *session;
+char tree[] = "/tmp/ftp_microbench_XXXXXX";
+char deep_path[BUFFER_SIZE];   // d1/d2/.../d32 below public
+volatile uintptr_t sink;       // keeps results from being optimized out
+
+// Back to server_data/public, as after CWD public on a new session
+void enter_public() {
+     close(session->dir_fd);
+     session->dir_fd = openat(root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+     snprintf(session->current_dir, sizeof(session->current_dir), "%s",
+              ROOT_DIR);
+     set_path(session, "public");
+}
+
+void bench_split(long iterations) {
+     char line[BUFFER_SIZE];
+     char *tokens[MAX_ARGUMENTS];
+     int tokens_count;
+     for (long i = 0; i < iterations; i++) {
+          // The tokenizer works in place, so every line is copied first
+          strcpy(line, corpus[i % CORPUS_SIZE]);
+          split_client_input(line, tokens, &tokens_count);
+          sink += (uintptr_t)tokens_count;
+     }
+}
+
+void bench_dispatch(long iterations) {
+     char verbs[CORPUS_SIZE][8];
+     for (size_t i = 0; i < CORPUS_SIZE; i++) {
+          sscanf(corpus[i], "%7s", verbs[i]);
+     }
+     for (long i = 0; i < iterations; i++) {
+          sink += (uintptr_t)find_command(pack_verb(verbs[i % CORPUS_SIZE]));
+     }
+}
+
+// The whole corpus arrives in one read and is taken apart line by line
+void bench_next_line(long iterations) {
+     char batch[BUFFER_SIZE];
+     size_t batch_len = 0;
+     for (size_t i = 0; i < CORPUS_SIZE; i++) {
+          size_t len = strlen(corpus[i]);
+          if (batch_len + len + 2 >= sizeof(batch)) break;
+          memcpy(batch + batch_len, corpus[i], len);
+          memcpy(batch + batch_len + len, "\r\n", 2);
+          batch_len += len + 2;
+     }
+
+     char line[BUFFER_SIZE];
+     bool too_long;
+     for (long i = 0; i < iterations; i++) {
+          if (session->input_len == 0) {
+               memcpy(session->input, batch, batch_len);
+               session->input_len = batch_len;
+          }
+          next_command_line(session, line, &too_long);
+          sink += (uintptr_t)line[0];
+     }
+     session->input_len = 0;
+}
+
+// CWD one level down and back up at the bottom of the tree, so every call
+// resolves TREE_DEPTH components
+void bench_set_path_deep(long iterations) {
+     char parent[BUFFER_SIZE];
+     snprintf(parent, sizeof(parent), "%s", deep_path);
+     *strrchr(parent, '/') = '\0';
+     enter_public();
+     set_path(session, parent);
+
+     const char *last = strrchr(deep_path, '/') + 1;
+     for (long i = 0; i < iterations; i++) {
+          sink += set_path(session, i % 2 == 0 ? last : "..");
+     }
+}
+
+void bench_set_path_shallow(long iterations) {
+     enter_public();
+     for (long i = 0; i < iterations; i++) {
+          sink += set_path(session, i % 2 == 0 ? "d1" : "..");
+     }
+}
+
+// A path that leaves the area is refused before anything is opened
+void bench_set_path_rejected(long iterations) {
+     enter_public();
+     for (long i = 0; i < iterations; i++) {
+          sink += set_path(session, "../../../etc");
+     }
+}
+
+// The lookup behind RETR, SIZE and MLST of a file TREE_DEPTH levels down
+void bench_open_beneath(long iterations) {
+     char path[PATH_MAX];
+     snprintf(path, sizeof(path), "%s/file.bin", deep_path);
+     enter_public();
+     for (long i = 0; i < iterations; i++) {
+          int fd = open_beneath(session->dir_fd, path, O_PATH | O_CLOEXEC, 0);
+          if (fd >= 0) close(fd);
+          sink += (uintptr_t)fd;
+     }
+}
+
+void bench_execute_noop(long iterations) {
+     char line[] = "NOOP";
+     char *tokens[] = {line};
+     char response[BUFFER_SIZE];
+     for (long i = 0; i < iterations; i++) {
+          execute_command(session, tokens, 1, response);
+          sink += (uintptr_t)response[0];
+     }
+}
+
+void bench_execute_size(long iterations) {
+     char verb[] = "SIZE";
+     char name[] = "file.bin";
+     char *tokens[] = {verb, name};
+     char response[BUFFER_SIZE];
+     enter_public();
+     for (long i = 0; i < iterations; i++) {
+          execute_command(session, tokens, 2, response);
+          sink += (uintptr_t)response[0];
+     }
+}
+
+// Gives back the port of the previous PASV, leases the next one and
+// formats the 227 reply. The passive range has no listeners behind it.
+void bench_execute_pasv(long iterations) {
+     char verb[] = "PASV";
+     char *tokens[] = {verb};
+     char response[BUFFER_SIZE];
+     for (long i = 0; i < iterations; i++) {
+          execute_command(session, tokens, 1, response);
+          sink += (uintptr_t)response[30];
+     }
+     release_pasv_port(session);
+}
+
+void bench_reply_list_line(long iterations) {
+     struct stat st;
+     char out[BUFFER_SIZE];
+     fstatat(root_fd, "public/file.bin", &st, 0);
+     for (long i = 0; i < iterations; i++) {
+          sink += (uintptr_t)format_list_line("file.bin", &st, out,
+                                              sizeof(out));
+     }
+}
+
+void bench_reply_facts(long iterations) {
+     struct stat st;
+     char out[BUFFER_SIZE];
+     fstatat(root_fd, "public/file.bin", &st, 0);
+     for (long i = 0; i < iterations; i++) {
+          sink += (uintptr_t)format_facts("file.bin", entry_type(&st), &st, out,
+                                          sizeof(out));
+     }
+}
+
+typedef struct {
+     const char *name;
+     void (*run)(long iterations);
+} Benchmark;
+
+Benchmark benchmarks[] = {
+    {"split_client_input", bench_split},
+    {"dispatch (pack_verb + find_command)", bench_dispatch},
+    {"next_command_line", bench_next_line},
+    {"set_path, depth 1", bench_set_path_shallow},
+    {"set_path, depth 32", bench_set_path_deep},
+    {"set_path, rejected", bench_set_path_rejected},
+    {"open_beneath, depth 32", bench_open_beneath},
+    {"execute_command NOOP", bench_execute_noop},
+    {"execute_command SIZE", bench_execute_size},
+    {"execute_command PASV", bench_execute_pasv},
+    {"reply: LIST line", bench_reply_list_line},
+    {"reply: MLSD facts", bench_reply_facts},
+};
+
+// Doubles the iteration count until a run takes BENCH_MIN_NS
+void run_benchmark(Benchmark *benchmark) {
+     long iterations = 1;
+     uint64_t elapsed = 0;
+     unsigned long allocated = 0;
+     benchmark->run(1000);  // warm up caches and lazy setup
+     while (1) {
+          unsigned long before = atomic_load(&allocations);
+          uint64_t started = monotonic_ns();
+          benchmark->run(iterations);
+          elapsed = monotonic_ns() - started;
+          allocated = atomic_load(&allocations) - before;
+          if (elapsed >= BENCH_MIN_NS || iterations >= (1L << 40)) break;
+          iterations *= 2;
+     }
+     printf("%-38s %12ld %10.1f %10.2f\n", benchmark->name, iterations,
+            (double)elapsed / (double)iterations,
+            (double)allocated / (double)iterations);
+}
+
+int remove_entry(const char *path, const struct stat *st, int type,
+                 struct FTW *ftw) {
+     (void)st;
+     (void)type;
+     (void)ftw;
+     return remove(path) < 0 ? -1 : 0;
+}
+
+// Deletes the directory tree again, deepest entries first
+void remove_tree() {
+     if (nftw(tree, remove_entry, 16, FTW_DEPTH | FTW_PHYS) < 0) {
+          perror("Cannot remove the directory tree");
+     }
+}
+
+// server_data/public/d1/.../d32 with a file at the top and the bottom, in
+// a fresh directory
+bool make_tree() {
+     if (mkdtemp(tree) == NULL) return false;
+     atexit(remove_tree);
+     if (chdir(tree) < 0 ||
+         mkdir("server_data", 0755) < 0 ||
+         mkdir("server_data/public", 0755) < 0) {
+          return false;
+     }
+     char path[BUFFER_SIZE] = "server_data/public";
+     size_t len = strlen(path);
+     deep_path[0] = '\0';
+     for (int depth = 1; depth <= TREE_DEPTH; depth++) {
+          len += (size_t)snprintf(path + len, sizeof(path) - len, "/d%d",
+                                  depth);
+          snprintf(deep_path + strlen(deep_path),
+                   sizeof(deep_path) - strlen(deep_path), "%sd%d",
+                   depth > 1 ? "/" : "", depth);
+          if (mkdir(path, 0755) < 0) return false;
+     }
+     snprintf(path + len, sizeof(path) - len, "/file.bin");
+     int fd = open(path, O_CREAT | O_WRONLY, 0644);
+     if (fd >= 0) close(fd);
+     fd = open("server_data/public/file.bin", O_CREAT | O_WRONLY, 0644);
+     if (fd >= 0) close(fd);
+     printf("Directory tree in %s\n", tree);
+     return true;
+}
+
+int main(int argc, char *argv[]) {
+     if (!make_tree()) {
+          perror("Cannot create the directory tree");
+          return EXIT_FAILURE;
+     }
+     root_fd = open(ROOT_DIR + 1, O_PATH | O_DIRECTORY | O_CLOEXEC);
+     session = create_session(-1);
+     pasv_port_count = PASV_PORT_MAX - PASV_PORT_MIN + 1;
+     pasv_ports = calloc((size_t)pasv_port_count, sizeof(PasvPort));
+     if (root_fd < 0 || session == NULL || pasv_ports == NULL) {
+          perror("Cannot set up a session");
+          return EXIT_FAILURE;
+     }
+     for (int i = 0; i < pasv_port_count; i++) {
+          pasv_ports[i].source.fd = -1;
+          pasv_ports[i].port = (uint16_t)(PASV_PORT_MIN + i);
+     }
+     session->local_addr.s_addr = htonl(INADDR_LOOPBACK);
+     // The listing cache only matters to LIST, leave it off
+     descriptor_path(root_fd, cache_root, sizeof(cache_root));
+
+     printf("%-38s %12s %10s %10s\n", "benchmark", "iterations", "ns/op",
+            "allocs/op");
+     for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+          // A name given on the command line selects the benchmarks to run
+          bool selected = argc < 2;
+          for (int arg = 1; arg < argc; arg++) {
+               selected = selected || strstr(benchmarks[i].name, argv[arg]);
+          }
+          if (selected) run_benchmark(&benchmarks[i]);
+     }
+     return 0;
+}
@@ -1,600 +1,6241 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #define FTP_PORT 21
 #define BUFFER_SIZE 1024
 #define MAX_ARGUMENTS 10
 #define ROOT_DIR "/server_data"
 
-#define NUM_VALID_COMMANDS 29
+#define MAX_EVENTS 256
+// Ports of the passive mode listeners, all opened at startup; --pasv-ports
+// picks another range
+#define PASV_PORT_MIN 50000
+#define PASV_PORT_MAX 50999
+// The passive listeners take at most this share of the descriptor limit,
+// the rest is left to the sessions
+#define PASV_PORT_FD_SHARE 4
+// RETR/STOR answer 425 when the client has not opened the data connection
+// by then
+#define DATA_WAIT_TIMEOUT_S 30
+// Pre-forked mode: the most worker processes, and how long one must have
+// run before it is started again right away after it dies
+#define MAX_PROCESSES 256
+#define WORKER_RESPAWN_DELAY_NS 1000000000ULL
+#define REPLY_BUFFER_SIZE (BUFFER_SIZE * 8)
+// Room the reply buffer must have left before the next pipelined command
+// runs; the longest replies (HELP, SITE STATS) fit in it
+#define MAX_REPLY_SIZE (BUFFER_SIZE * 4)
+// Upper bound on chunks moved per readiness event, so one fast transfer
+// cannot starve the other sessions sharing the event loop
+#define TRANSFER_CHUNKS_PER_EVENT 64
+#define TRANSFER_BUFFER_SIZE (BUFFER_SIZE * 16)
+// Bytes a zero-copy RETR hands to the kernel per call, and per readiness event
+#define ZERO_COPY_CHUNK_SIZE (256 * 1024)
+#define ZERO_COPY_BYTES_PER_EVENT (4 * 1024 * 1024)
+// STOR starts writeback of every completed window while the next one is
+// still being received
+#define WRITE_BEHIND_WINDOW (8 * 1024 * 1024)
+// With the io_uring backend a transfer submits this many linked
+// fill/drain splice pairs per system call
+#define URING_BATCH_PAIRS 8
+#define URING_ENTRIES (URING_BATCH_PAIRS * 2)
+// MODE B block header: a descriptor byte, then the length of the data
+// that follows as a 16-bit big-endian count
+#define BLOCK_HEADER_SIZE 3
+#define BLOCK_MAX_DATA 0xFFFF
+#define BLOCK_EOF 0x40      // last block of the file
+#define BLOCK_RESTART 0x10  // restart marker, not file data
+// Bandwidth scheduler: RETR and STOR draw their bytes from token buckets.
+// Buckets hold RATE_BURST_MS worth of their rate, a session waits until it
+// can move at least RATE_MIN_GRANT bytes, and sessions sharing the global
+// limit take turns of RATE_QUANTUM bytes times their weight. Waiting
+// sessions are checked every RATE_TICK_MS.
+#define RATE_BURST_MS 100
+#define RATE_MIN_GRANT (16 * 1024)
+#define RATE_QUANTUM (64 * 1024)
+#define RATE_TICK_MS 10
+#define RATE_TABLE_SIZE 256
+#define RATE_KEY_SIZE 64
+#define RATE_MAX_WEIGHT 100
+#define ADMIN_USER "user1"
+// Accounts are read from USERS_FILE and reread on SIGHUP. New password
+// hashes use USER_HASH_ITERATIONS rounds of PBKDF2-HMAC-SHA256; logins
+// that passed it are remembered for AUTH_CACHE_TTL_S.
+#define USERS_FILE "server_users"
+#define USER_SALT_SIZE 16
+#define USER_HASH_ITERATIONS 50000
+#define AUTH_CACHE_SLOTS 4096
+#define AUTH_CACHE_NAME_SIZE 64
+#define AUTH_CACHE_TTL_S 60
+// Directory entries read per getdents64 call of a listing
+#define LISTING_BATCH_SIZE (BUFFER_SIZE * 8)
+// SITE TAR: archives are made of 512-byte blocks. The transfer buffer must
+// hold the headers of one entry, a long name included, before it is sent.
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_DEPTH 64
+#define TAR_ENTRY_ROOM \
+     (2 * TAR_BLOCK_SIZE + (PATH_MAX + TAR_BLOCK_SIZE) / TAR_BLOCK_SIZE * \
+                               TAR_BLOCK_SIZE)
+// Bounds of the shared path and listing cache; listings larger than
+// CACHE_MAX_LISTING are always read from the directory
+#define CACHE_BUCKETS 4096
+#define CACHE_MAX_ENTRIES 16384
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define CACHE_MAX_LISTING (4 * 1024 * 1024)
+// Contents of small files served by RETR, kept in memory; --file-cache
+// changes the total
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_MAX_FILE (256 * 1024)
+#define FILE_CACHE_MAX_BYTES (64 * 1024 * 1024)
+// HASH and XCRC read files in pieces of DIGEST_READ_SIZE, at most
+// DIGEST_READS_PER_EVENT of them before other sessions get their turn, and
+// keep the digest in an extended attribute, valid while mtime and size stay
+#define DIGEST_READ_SIZE (1024 * 1024)
+#define DIGEST_READS_PER_EVENT 4
+#define DIGEST_HEX_SIZE 65
+#define DIGEST_XATTR_PREFIX "user.ftp."
+#define CACHE_WATCH_MASK                                                   \
+     (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+      IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
 
-char current_dir[BUFFER_SIZE] = ROOT_DIR;
+// Commands in the order of the dispatch table; the id of a listing command
+// is also the kind of its cache entries
+typedef enum {
+     CMD_USER,
+     CMD_PASS,
+     CMD_ACCT,
+     CMD_CWD,
+     CMD_CDUP,
+     CMD_SMNT,
+     CMD_QUIT,
+     CMD_REIN,
+     CMD_PORT,
+     CMD_PASV,
+     CMD_TYPE,
+     CMD_STRU,
+     CMD_MODE,
+     CMD_RETR,
+     CMD_STOR,
+     CMD_DELE,
+     CMD_RNFR,
+     CMD_RNTO,
+     CMD_ABOR,
+     CMD_LIST,
+     CMD_NLST,
+     CMD_SITE,
+     CMD_SYST,
+     CMD_STAT,
+     CMD_HELP,
+     CMD_NOOP,
+     CMD_PWD,
+     CMD_MKD,
+     CMD_RMD,
+     CMD_ALLO,
+     CMD_REST,
+     CMD_SIZE,
+     CMD_MDTM,
+     CMD_MFMT,
+     CMD_RANG,
+     CMD_MLSD,
+     CMD_MLST,
+     CMD_OPTS,
+     CMD_HASH,
+     CMD_XCRC,
+     NUM_COMMANDS
+} CommandId;
 
-const char *valid_commands[] = {"USER", "PASS", "ACCT", "CWD",  "CDUP", "SMNT",
-                                "QUIT", "REIN", "PORT", "PASV", "TYPE", "STRU",
-                                "MODE", "RETR", "STOR", "DELE", "RNFR", "RNTO",
-                                "ABOR", "LIST", "NLST", "SITE", "SYST", "STAT",
-                                "HELP", "NOOP", "PWD",  "MKD",  "RMD"};
+// Log levels, most severe first. Calls above LOG_LEVEL are compiled out;
+// build with -DLOG_LEVEL=LOG_DEBUG to also see every command and transfer.
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
 
-typedef struct {
-     int active;  // 1 for active, 0 for passive
-     int data_socket;
-     struct sockaddr_in client_addr;
-} DataConnection;
+#define log_at(level, ...)                                         \
+     do {                                                           \
+          if ((level) <= LOG_LEVEL) log_write((level), __VA_ARGS__); \
+     } while (0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
 
-DataConnection data_connection = {0, -1, {0}};
+// Every thread that logs gets a ring of LOG_RING_SLOTS lines. A background
+// thread prints them, so a session never waits for stdout; a thread whose
+// ring is full drops the line and the drain thread reports how many.
+#define LOG_RING_SLOTS 1024
+#define LOG_LINE_SIZE 256
+#define LOG_DRAIN_INTERVAL_MS 20
 
 typedef struct {
-     bool authenticated;
-     char username[BUFFER_SIZE];
-} ClientSession;
+     int level;
+     struct timespec time;
+     char text[LOG_LINE_SIZE];
+} LogRecord;
 
-ClientSession client_session;
+typedef struct LogRing {
+     LogRecord records[LOG_RING_SLOTS];
+     _Atomic unsigned long head;  // written by the owning thread
+     _Atomic unsigned long tail;  // written by the drain thread
+     _Atomic unsigned long dropped;
+     struct LogRing *next;
+} LogRing;
 
-const char *valid_users[][2] = {{"user1", "password1"}, {"user2", "password2"}};
-const int NUM_USERS = 2;
+_Atomic(LogRing *) log_rings = NULL;
+__thread LogRing *log_ring = NULL;
+// Held while draining, so log_flush can run next to the drain thread
+pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void split_client_input(const char *input, char *tokens[], int *token_count) {
-     *token_count = 0;
-     char buffer[BUFFER_SIZE];
+const char *log_level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
 
-     strncpy(buffer, input, sizeof(buffer) - 1);
-     buffer[sizeof(buffer)] = '\0';
+LogRing *log_register_thread() {
+     LogRing *ring = calloc(1, sizeof(LogRing));
+     if (ring == NULL) return NULL;
 
-     char *token = strtok(buffer, " ");
-     while (token != NULL && *token_count < MAX_ARGUMENTS) {
-          tokens[*token_count] = token;
-          (*token_count)++;
-          token = strtok(NULL, " ");
+     // Rings are never freed, so the list only grows at its head
+     ring->next = atomic_load(&log_rings);
+     while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
      }
+     log_ring = ring;
+     return ring;
 }
 
-bool validate_credentials(const char *username, const char *password) {
-     for (int i = 0; i < NUM_USERS; i++) {
-          if (strcmp(username, valid_users[i][0]) == 0 &&
-              strcmp(password, valid_users[i][1]) == 0) {
-               return true;
+__attribute__((format(printf, 2, 3))) void log_write(int level,
+                                                     const char *format,
+                                                     ...) {
+     // %m in the format refers to the errno of the caller
+     int saved_errno = errno;
+     LogRing *ring = log_ring != NULL ? log_ring : log_register_thread();
+     va_list args;
+     va_start(args, format);
+     errno = saved_errno;
+
+     if (ring == NULL) {
+          // Without a ring the line goes out directly
+          vfprintf(stderr, format, args);
+          fputc('\n', stderr);
+     } else {
+          unsigned long head =
+              atomic_load_explicit(&ring->head, memory_order_relaxed);
+          unsigned long tail =
+              atomic_load_explicit(&ring->tail, memory_order_acquire);
+          if (head - tail == LOG_RING_SLOTS) {
+               atomic_fetch_add_explicit(&ring->dropped, 1,
+                                         memory_order_relaxed);
+          } else {
+               LogRecord *record = &ring->records[head % LOG_RING_SLOTS];
+               record->level = level;
+               clock_gettime(CLOCK_REALTIME, &record->time);
+               errno = saved_errno;
+               vsnprintf(record->text, sizeof(record->text), format, args);
+               atomic_store_explicit(&ring->head, head + 1,
+                                     memory_order_release);
           }
      }
-     return false;
+     va_end(args);
+     errno = saved_errno;
 }
 
-bool path_exists(const char *relative_path) {
-     relative_path++;
-     printf("%s\n", relative_path);
-     char *absolute_path = realpath(relative_path, NULL);
-     if (absolute_path == NULL) {
-          // realpath failed, the path may not exist
-          perror("Error resolving absolute path");
-          return false;
+// Writes out a batch of formatted lines, errors and warnings to stderr
+void log_output(int fd, char *batch, size_t *len) {
+     size_t written = 0;
+     while (written < *len) {
+          ssize_t n = write(fd, batch + written, *len - written);
+          if (n < 0 && errno == EINTR) continue;
+          if (n <= 0) break;
+          written += (size_t)n;
      }
+     *len = 0;
+}
 
-     // Check if the absolute path exists
-     if (access(absolute_path, F_OK) == 0) {
-          printf("Path exists: %s\n", absolute_path);
-          free(absolute_path);  // Remember to free the allocated memory for the
-                                // absolute path
-          return true;
-     } else {
-          printf("Path does not exist: %s\n", absolute_path);
-          free(absolute_path);  // Free the memory
-          return false;
+// Prints what all threads have queued so far, returns the number of lines
+size_t log_drain() {
+     static char batches[2][BUFFER_SIZE * 16];
+     size_t lens[2] = {0, 0};
+     size_t lines = 0;
+
+     pthread_mutex_lock(&log_drain_lock);
+     for (LogRing *ring = atomic_load(&log_rings); ring != NULL;
+          ring = ring->next) {
+          unsigned long dropped = atomic_exchange(&ring->dropped, 0);
+          if (dropped > 0) {
+               if (sizeof(batches[1]) - lens[1] < LOG_LINE_SIZE + 64) {
+                    log_output(STDERR_FILENO, batches[1], &lens[1]);
+               }
+               lens[1] += (size_t)snprintf(
+                   batches[1] + lens[1], sizeof(batches[1]) - lens[1],
+                   "WARN  %lu log lines dropped\n", dropped);
+          }
+
+          unsigned long tail =
+              atomic_load_explicit(&ring->tail, memory_order_relaxed);
+          unsigned long head =
+              atomic_load_explicit(&ring->head, memory_order_acquire);
+          for (; tail != head; tail++) {
+               LogRecord *record = &ring->records[tail % LOG_RING_SLOTS];
+               int stream = record->level <= LOG_WARN ? 1 : 0;
+               // Room for the longest line with its timestamp
+               if (sizeof(batches[stream]) - lens[stream] <
+                   LOG_LINE_SIZE + 64) {
+                    log_output(stream == 1 ? STDERR_FILENO : STDOUT_FILENO,
+                               batches[stream], &lens[stream]);
+               }
+
+               struct tm tm;
+               localtime_r(&record->time.tv_sec, &tm);
+               char *out = batches[stream] + lens[stream];
+               size_t room = sizeof(batches[stream]) - lens[stream];
+               size_t len = strftime(out, room, "%Y-%m-%d %H:%M:%S", &tm);
+               len += (size_t)snprintf(
+                   out + len, room - len, ".%03ld %-5s %s\n",
+                   record->time.tv_nsec / 1000000,
+                   log_level_names[record->level], record->text);
+               lens[stream] += len < room ? len : room - 1;
+               lines++;
+          }
+          atomic_store_explicit(&ring->tail, tail, memory_order_release);
      }
+     log_output(STDOUT_FILENO, batches[0], &lens[0]);
+     log_output(STDERR_FILENO, batches[1], &lens[1]);
+     pthread_mutex_unlock(&log_drain_lock);
+     return lines;
 }
 
-bool is_within_server_data(const char *path) {
-     char abs_path[BUFFER_SIZE];
-     realpath(path, abs_path);
-     return strncmp(abs_path, ROOT_DIR, strlen(ROOT_DIR)) == 0;
+void *log_main(void *arg) {
+     (void)arg;
+     struct timespec interval = {0, LOG_DRAIN_INTERVAL_MS * 1000000L};
+     while (1) {
+          // Keeps draining while the rings fill faster than the interval
+          if (log_drain() == 0) nanosleep(&interval, NULL);
+     }
+     return NULL;
 }
 
-bool set_path(const char *new_dir) {
-     if (new_dir == NULL || strcmp(new_dir, "") == 0) {
-          return false;
+// Lines logged before the drain thread starts are kept in the rings
+void log_start() {
+     pthread_t thread;
+     if (pthread_create(&thread, NULL, log_main, NULL) != 0) {
+          perror("Failed to start the log thread");
+          return;
      }
+     pthread_detach(thread);
+}
 
-     char temp_path[BUFFER_SIZE];
-     snprintf(temp_path, sizeof(temp_path), "%s", current_dir);
+// Histograms keep HIST_SUB_BUCKETS linear buckets per power of two, like an
+// HDR histogram with one significant digit: any 64-bit value is recorded
+// with an error of at most 1/8
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+// Room for the text exposition served on the metrics socket
+#define METRICS_TEXT_SIZE (64 * 1024)
+#define METRICS_SOCKET "server_metrics.sock"
 
-     char *token = strtok(strdup(new_dir), "/");
-     while (token != NULL) {
-          if (strcmp(token, "..") == 0) {
-               // Handle "..", go up one directory if possible
-               // Avoid going above /server_data
-               if (strcmp(temp_path, ROOT_DIR) == 0) {
-                    // Already at /server_data, can't go further up
-                    return false;
-               }
+typedef struct {
+     _Atomic uint64_t buckets[HIST_BUCKETS];
+     _Atomic uint64_t count;
+     _Atomic uint64_t sum;
+     _Atomic uint64_t max;
+} Histogram;
 
-               // Try to move one directory up
-               char *last_slash = strrchr(temp_path, '/');
-               if (last_slash != NULL) {
-                    *last_slash = '\0';  // Remove the last directory
-               }
-          } else {
-               // Otherwise, it's a subdirectory, so append it
-               if (strlen(temp_path) + strlen(token) + 2 < sizeof(temp_path)) {
-                    strcat(temp_path, "/");
-                    strcat(temp_path, token);
-               } else {
-                    return false;  // Path too long
-               }
+// Updated with relaxed atomics by every worker, read by SITE STATS and the
+// metrics socket. Counts of a command are those of its histogram.
+typedef struct {
+     Histogram command_latency[NUM_COMMANDS];  // nanoseconds
+     _Atomic uint64_t unknown_commands;
+     _Atomic uint64_t bytes_received;
+     _Atomic uint64_t bytes_sent;
+     _Atomic uint64_t transfers_ok;
+     _Atomic uint64_t transfers_failed;
+     Histogram transfer_duration;    // microseconds
+     Histogram transfer_throughput;  // bytes per second
+     _Atomic long sessions_active;
+     _Atomic uint64_t sessions_total;
+     _Atomic long pasv_leases;
+     _Atomic uint64_t cache_hits;
+     _Atomic uint64_t cache_misses;
+     _Atomic uint64_t file_cache_hits;
+     _Atomic uint64_t file_cache_misses;
+     _Atomic uint64_t file_cache_evictions;
+     _Atomic uint64_t logins_ok;
+     _Atomic uint64_t logins_failed;
+     _Atomic uint64_t auth_cache_hits;
+     _Atomic uint64_t digests_stored;    // answered from the xattr
+     _Atomic uint64_t digests_computed;  // the file had to be read
+} Metrics;
+
+Metrics metrics;
+const char *metrics_socket_path = METRICS_SOCKET;
+
+#define metrics_add(counter, value) \
+     atomic_fetch_add_explicit(&metrics.counter, (value), memory_order_relaxed)
+
+uint64_t monotonic_ns() {
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+unsigned histogram_bucket(uint64_t value) {
+     if (value < HIST_SUB_BUCKETS) return (unsigned)value;
+     int exponent = 63 - __builtin_clzll(value);
+     int shift = exponent - HIST_SUB_BITS;
+     return (unsigned)(shift + 1) * HIST_SUB_BUCKETS +
+            (unsigned)((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls into the bucket
+uint64_t histogram_bucket_limit(unsigned bucket) {
+     if (bucket < HIST_SUB_BUCKETS) return bucket;
+     unsigned shift = bucket / HIST_SUB_BUCKETS - 1;
+     uint64_t base = HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS;
+     return ((base + 1) << shift) - 1;
+}
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+     atomic_fetch_add_explicit(&histogram->buckets[histogram_bucket(value)], 1,
+                               memory_order_relaxed);
+     atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+     atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+     uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+     while (value > max &&
+            !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed)) {
+     }
+}
+
+// Upper bound of the value below which the given fraction of the recorded
+// values fall, 0 for an empty histogram
+uint64_t histogram_quantile(Histogram *histogram, double quantile) {
+     uint64_t count =
+         atomic_load_explicit(&histogram->count, memory_order_relaxed);
+     uint64_t rank = (uint64_t)(quantile * (double)count + 0.5);
+     if (rank == 0) rank = 1;
+     uint64_t seen = 0;
+     for (unsigned i = 0; i < HIST_BUCKETS && count > 0; i++) {
+          seen += atomic_load_explicit(&histogram->buckets[i],
+                                       memory_order_relaxed);
+          if (seen >= rank) {
+               uint64_t max = atomic_load_explicit(&histogram->max,
+                                                   memory_order_relaxed);
+               uint64_t limit = histogram_bucket_limit(i);
+               return limit < max ? limit : max;
           }
-          token = strtok(NULL, "/");
      }
+     return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+typedef struct {
+     int active;  // 1 for active, 0 for passive
+     int data_socket;
+     struct sockaddr_in client_addr;
+} DataConnection;
 
-     // modify from here
-     char public_path[BUFFER_SIZE];
-     char user_path[BUFFER_SIZE];
+typedef struct {
+     bool authenticated;
+     char username[BUFFER_SIZE];
+} ClientSession;
 
-     snprintf(public_path, sizeof(public_path), "%.900s/public", ROOT_DIR);
+typedef enum {
+     SESSION_READING,    // running commands as they come in
+     SESSION_DATA_WAIT,  // RETR/STOR waiting for the data connection
+     SESSION_SENDING,    // RETR/LIST streaming to the client
+     SESSION_RECEIVING,  // STOR streaming the file from the client
+     SESSION_HASHING,    // HASH/XCRC reading the file for its digest
+     SESSION_CLOSING     // QUIT answered, close once the reply is out
+} SessionState;
 
-     if (client_session.authenticated && client_session.username != NULL) {
-          snprintf(user_path, sizeof(user_path), "%.900s/%.100s", ROOT_DIR,
-                   client_session.username);
-     }
+// How RETR moves the file; each method falls back to the next one when the
+// kernel refuses it for this file
+typedef enum {
+     SEND_SENDFILE,  // page cache -> socket
+     SEND_SPLICE,    // page cache -> pipe -> socket
+     SEND_BUFFERED,  // read into user space, then send
+     SEND_CACHED     // from the file cache, no fallback needed
+} SendMethod;
 
-     if ((path_exists(temp_path) && is_within_server_data(temp_path)) &&
-         (strncmp(temp_path, public_path, strlen(public_path)) == 0 ||
-          (client_session.authenticated && client_session.username != NULL &&
-           strncmp(temp_path, user_path, strlen(user_path)) == 0))) {
-          strncpy(current_dir, temp_path, sizeof(current_dir) - 1);
-          return true;
+// How STOR moves the upload, with the same fallback rule
+typedef enum {
+     RECEIVE_SPLICE,   // socket -> pipe -> page cache
+     RECEIVE_BUFFERED  // recv into user space, then write
+} ReceiveMethod;
+
+typedef enum {
+     SOURCE_LISTENER,
+     SOURCE_INOTIFY,
+     SOURCE_PASV_PORT,
+     SOURCE_RATE_TIMER,
+     SOURCE_SIGNAL,
+     SOURCE_CONTROL,
+     SOURCE_PASV,
+     SOURCE_DATA,
+     SOURCE_DATA_TIMER
+} SourceKind;
+
+// Digests of HASH; SHA-256 is the default of every session
+typedef enum {
+     HASH_SHA256,
+     HASH_CRC32C,
+     HASH_XXH64,
+     NUM_HASH_ALGORITHMS
+} HashAlgorithm;
+
+typedef struct Session Session;
+typedef struct DigestJob DigestJob;
+
+// Limit and weight of one user or client address, with the bucket all of
+// its transfers draw from. A rate of -1 or a weight of 0 follows the
+// default entry ("*") of its table. Entries SITE LIMIT or WEIGHT did not
+// set only live while transfers hold them.
+typedef struct RateEntry {
+     char key[RATE_KEY_SIZE];
+     long long rate;  // bytes per second, 0 for no limit
+     int weight;
+     double tokens;
+     uint64_t refilled;  // monotonic ns of the last refill
+     struct RateEntry *next;
+     int transfers;  // holding it
+} RateEntry;
+
+typedef struct {
+     const char *name;  // as SITE LIMIT calls it
+     RateEntry fallback;
+     RateEntry *entries[RATE_TABLE_SIZE];
+} RateTable;
+
+// Serialized listing or file contents, shared by the cache and the
+// sessions sending it
+typedef struct {
+     atomic_int refs;
+     size_t len;
+     size_t capacity;
+     char data[];
+} CacheBlob;
+
+// SITE TAR in progress: the directories being walked, innermost last, each
+// with the length its archive path has in path. Only the current level is
+// read through the dirents of the session; a level that is left for a
+// subdirectory was positioned right behind it and is read again later.
+typedef struct {
+     int dir_fds[TAR_MAX_DEPTH];
+     size_t path_lens[TAR_MAX_DEPTH];
+     int depth;
+     char path[PATH_MAX];
+     bool started;    // the header of the top directory is out
+     bool finished;   // the end of the archive is out
+     off_t padding;   // zeros owed after the body of the last file
+} TarWalk;
+
+// One cached listing, keyed by the LIST, NLST or MLSD command id and the
+// directory, on a hash chain and on the LRU list
+typedef struct CacheEntry {
+     int kind;
+     char *key;       // path as it was looked up
+     char *resolved;  // what it resolved to, matched on invalidation
+     CacheBlob *listing;
+     size_t bytes;
+     struct CacheEntry *next;
+     struct CacheEntry *lru_prev;
+     struct CacheEntry *lru_next;
+} CacheEntry;
+
+// Contents of one file, found by device and inode and only valid while
+// the file keeps its modification time and size. On a hash chain and on
+// the LRU list of the file cache.
+typedef struct FileCacheEntry {
+     dev_t dev;
+     ino_t ino;
+     struct timespec mtime;
+     CacheBlob *contents;  // len is the file size
+     struct FileCacheEntry *next;
+     struct FileCacheEntry *lru_prev;
+     struct FileCacheEntry *lru_next;
+} FileCacheEntry;
+
+// inotify watch of a directory some cached entry depends on
+typedef struct CacheWatch {
+     int wd;
+     char *path;
+     unsigned long changed;  // cache clock of the last change seen in it
+     struct CacheWatch *next_by_wd;
+     struct CacheWatch *next_by_path;
+     struct CacheWatch *next_all;
+} CacheWatch;
+
+// One registered descriptor; epoll hands this back so the loop knows which
+// socket of which session became ready. Session descriptors are registered
+// one-shot and re-armed by the worker once it is done with the session.
+typedef struct {
+     SourceKind kind;
+     int fd;
+     uint32_t events;  // wanted events, applied when the session is re-armed
+     bool registered;
+     _Atomic uint32_t ready;  // events reported but not handled yet
+     Session *session;
+} EventSource;
+
+// A listener of the passive port range. Sessions lease it for their next
+// data connection, and a connection goes to the lessee whose control
+// connection comes from the same address, so clients on different hosts
+// share a port. A session never leases a port its own host already holds.
+typedef struct {
+     EventSource source;  // level-triggered, served by the event loop
+     uint16_t port;
+     Session *lessees;    // linked through Session.next_lessee
+} PasvPort;
+
+struct Session {
+     EventSource control;
+     // Has no descriptor of its own: the event loop reports EPOLLIN on it
+     // when it hands over the connection of the leased passive port
+     EventSource pasv;
+     EventSource data;
+     // timerfd with the deadline of SESSION_DATA_WAIT, made on the first
+     // wait and kept for the session
+     EventSource data_timer;
+     SessionState state;
+     bool closed;
+     Session *next_closed;
+
+     // Set while the session sits in a work queue or runs on a worker, so
+     // only one thread touches it at a time
+     atomic_bool scheduled;
+     int home_worker;
+     Session *next_overflow;  // in the overflow list of a work queue
+
+     char current_dir[BUFFER_SIZE];
+     // The current directory itself; every path a command names is resolved
+     // beneath it by the kernel
+     int dir_fd;
+     char dir_path[PATH_MAX];  // where dir_fd really is, for the cache
+     ClientSession client_session;
+     DataConnection data_connection;
+     struct in_addr local_addr;  // both ends of the control connection
+     struct in_addr peer_addr;
+     PasvPort *pasv_port;  // leased by the last PASV, NULL once handed over
+     Session *next_lessee;
+     _Atomic int pasv_accepted;  // data connection handed over, or -1
+
+     // Control channel buffers
+     char input[BUFFER_SIZE];
+     size_t input_len;
+     bool discarding;  // dropping the rest of an overlong command line
+     char output[REPLY_BUFFER_SIZE];
+     size_t output_len;
+     size_t output_sent;
+
+     // Transfer in progress (RETR or STOR)
+     int transfer_command;
+     int file_fd;
+     off_t file_offset;
+     off_t bytes_transferred;
+     uint64_t transfer_started;  // monotonic ns, 0 before the data connection
+     SendMethod send_method;
+     ReceiveMethod receive_method;
+     off_t allocate_size;     // from ALLO, applies to the next STOR
+     off_t restart_offset;    // from REST, applies to the next RETR/STOR
+     off_t restart_end;       // from RANG, exclusive end or -1 for none
+     off_t file_end;          // the transfer stops here, -1 at the end
+     off_t writeback_offset;  // STOR data before this is being written back
+     int pipe_fds[2];  // splice transfers, created on first use
+     size_t pipe_len;  // bytes spliced into the pipe but not moved out yet
+     bool use_uring;   // this transfer runs on the worker's io_uring
+     char file_path[BUFFER_SIZE];  // relative to dir_fd
+
+     // Bandwidth scheduling of the transfer in progress, guarded by
+     // rate_lock apart from the entries, which only this session sets
+     RateEntry *rate_user;  // held from the first grant to the end
+     RateEntry *rate_host;
+     size_t rate_credit;  // global bytes the scheduler set aside for it
+     bool rate_parked;    // waiting in rate_waiters
+     Session *rate_next;
+
+     // MODE B frames every transfer in blocks, so the data connection
+     // stays open from one transfer to the next. The header of the block
+     // being sent or received, how much of it has been, and the data bytes
+     // of the block still to come.
+     bool block_mode;
+     unsigned char block_header[BLOCK_HEADER_SIZE];
+     size_t block_header_len;
+     size_t block_left;
+     bool block_eof;  // the current block is the last of the transfer
+
+     HashAlgorithm hash_algorithm;  // chosen with OPTS HASH
+     DigestJob *digest_job;  // HASH or XCRC: file_fd is the file being read
+
+     char transfer_buffer[TRANSFER_BUFFER_SIZE];
+     size_t transfer_len;
+     size_t transfer_sent;
+
+     // Listing in progress (LIST, NLST, MLSD): file_fd is the directory,
+     // its entries are formatted into the transfer buffer batch by batch
+     char dirents[LISTING_BATCH_SIZE] __attribute__((aligned(8)));
+     size_t dirents_len;
+     size_t dirents_pos;
+     CacheBlob *cached_listing;  // listing sent from the cache instead
+     size_t cached_pos;
+     CacheBlob *new_listing;  // copy of a listing read from the directory
+     CacheBlob *cached_file;  // contents RETR sends from the file cache
+     TarWalk *tar;  // SITE TAR: file_fd is the file whose body goes next
+     unsigned long listing_start;  // cache clock when reading started
+};
+
+typedef enum {
+     IO_BACKEND_SYSCALL,  // one system call per operation
+     IO_BACKEND_URING     // batched through a per-worker io_uring
+} IoBackend;
+
+// Submission and completion rings of one io_uring instance, driven with
+// the raw system calls
+typedef struct {
+     int fd;
+     unsigned *sq_tail;
+     unsigned *sq_mask;
+     unsigned *sq_array;
+     unsigned *cq_head;
+     unsigned *cq_tail;
+     unsigned *cq_mask;
+     struct io_uring_sqe *sqes;
+     struct io_uring_cqe *cqes;
+     unsigned pending;  // prepared but not submitted yet
+} Uring;
+
+// Work-stealing deque: the owner pushes and pops at the bottom, idle
+// workers steal from the top. Sessions that come while the ring is full
+// and cannot grow wait on the overflow list, linked through the sessions.
+typedef struct {
+     pthread_mutex_t lock;
+     Session **sessions;
+     size_t capacity;
+     size_t top;
+     size_t count;
+     Session *overflow;
+} WorkQueue;
+
+typedef struct {
+     pthread_t thread;
+     int id;
+     WorkQueue queue;
+     Uring ring;
+} Worker;
+
+int epoll_fd = -1;
+// server_data, which every session directory lies beneath
+int root_fd = -1;
+
+IoBackend io_backend = IO_BACKEND_SYSCALL;
+// Ring of the worker running on this thread
+__thread Uring *worker_ring = NULL;
+
+Worker *workers = NULL;
+int num_workers = 0;
+
+// Pre-forked mode (--processes): a supervisor runs num_processes copies of
+// the server, each with its own listener on the control port. process_index
+// is the copy this process is, -1 outside of that mode.
+int num_processes = 1;
+int process_index = -1;
+
+// The passive port range. pasv_lock guards the lessee lists, which the
+// workers change on PASV and the event loop on every accepted connection.
+pthread_mutex_t pasv_lock = PTHREAD_MUTEX_INITIALIZER;
+int pasv_port_min = PASV_PORT_MIN;
+int pasv_port_max = PASV_PORT_MAX;
+PasvPort *pasv_ports = NULL;
+int pasv_port_count = 0;
+int pasv_next_port = 0;  // where the search for a free port starts
+
+// Number of sessions waiting in any work queue; idle workers sleep on it
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+size_t queued_sessions = 0;
+
+// Bandwidth limits. rate_limited is set while any limit is, so transfers
+// skip the scheduler altogether when there is none.
+pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_bool rate_limited = false;
+long long global_rate = 0;
+double global_tokens = 0;
+uint64_t global_refilled = 0;
+RateTable rate_users = {"USER", {"*", 0, 1, 0, 0, NULL, 0}, {NULL}};
+RateTable rate_hosts = {"IP", {"*", 0, 1, 0, 0, NULL, 0}, {NULL}};
+// Sessions waiting for bandwidth, in the order they get their turn
+Session *rate_waiters = NULL;
+Session **rate_waiters_tail = &rate_waiters;
+int rate_timer_fd = -1;
+bool rate_timer_armed = false;
+const char *admin_user = ADMIN_USER;
+
+// Sessions closed by the workers, freed by the event loop between two
+// epoll_wait calls so no event still in flight can refer to them
+pthread_mutex_t closed_lock = PTHREAD_MUTEX_INITIALIZER;
+Session *closed_sessions = NULL;
+
+// Listing cache, shared by all workers. The cache clock ticks on
+// every change, so a lookup that raced with one is not stored.
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+int inotify_fd = -1;  // -1 when the cache is disabled
+char cache_root[PATH_MAX];
+CacheEntry *cache_table[CACHE_BUCKETS];
+CacheEntry *cache_lru_head = NULL;  // most recently used
+CacheEntry *cache_lru_tail = NULL;
+size_t cache_entries = 0;
+size_t cache_bytes = 0;
+CacheWatch *watches_by_wd[CACHE_BUCKETS];
+CacheWatch *watches_by_path[CACHE_BUCKETS];
+CacheWatch *all_watches = NULL;
+unsigned long cache_clock = 0;
+unsigned long cache_flushed = 0;  // clock of the last full flush
+
+// File cache, shared by all workers. Entries are checked against the
+// file on every hit, so it needs no inotify watches.
+pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+FileCacheEntry *file_cache_table[FILE_CACHE_BUCKETS];
+FileCacheEntry *file_cache_lru_head = NULL;  // most recently used
+FileCacheEntry *file_cache_lru_tail = NULL;
+size_t file_cache_bytes = 0;
+size_t file_cache_limit = FILE_CACHE_MAX_BYTES;  // 0 turns the cache off
+
+bool uring_setup(Uring *ring) {
+     struct io_uring_params params;
+     memset(&params, 0, sizeof(params));
+
+     ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+     if (ring->fd < 0) return false;
+
+     size_t sq_size =
+         params.sq_off.array + params.sq_entries * sizeof(unsigned);
+     size_t cq_size = params.cq_off.cqes +
+                      params.cq_entries * sizeof(struct io_uring_cqe);
+     bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+     if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+     char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+     char *cq = single_mmap
+                    ? sq
+                    : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+     ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQES);
+     if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+          close(ring->fd);
+          ring->fd = -1;
+          return false;
      }
 
-     return false;  // The path is invalid or outside of /server_data
+     ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+     ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+     ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+     ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+     ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+     ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+     ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+     ring->pending = 0;
+     return true;
+}
+
+// The user_data of each request is its index in the batch
+struct io_uring_sqe *uring_prepare(Uring *ring, uint8_t opcode, int fd) {
+     unsigned index = (*ring->sq_tail + ring->pending) & *ring->sq_mask;
+     struct io_uring_sqe *sqe = &ring->sqes[index];
+
+     memset(sqe, 0, sizeof(*sqe));
+     sqe->opcode = opcode;
+     sqe->fd = fd;
+     sqe->user_data = ring->pending;
+     ring->sq_array[index] = index;
+     ring->pending++;
+     return sqe;
 }
 
-int is_valid_command(const char *command) {
-     for (int i = 0; i < NUM_VALID_COMMANDS; i++) {
-          if (strcmp(command, valid_commands[i]) == 0) {
-               return i;
+// Submits everything prepared with one system call and waits for all of
+// it; results[i] receives the result of the i-th request
+bool uring_submit_and_wait(Uring *ring, int *results) {
+     unsigned count = ring->pending;
+     ring->pending = 0;
+     __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+
+     unsigned submitted = 0;
+     unsigned completed = 0;
+     while (completed < count) {
+          unsigned head = *ring->cq_head;
+          unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+          while (head != tail) {
+               struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+               results[cqe->user_data] = cqe->res;
+               head++;
+               completed++;
+          }
+          __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+          if (completed == count) break;
+
+          int ret = (int)syscall(__NR_io_uring_enter, ring->fd,
+                                 count - submitted, count - completed,
+                                 IORING_ENTER_GETEVENTS, NULL, 0);
+          if (ret < 0) {
+               if (errno == EINTR) continue;
+               log_error("io_uring_enter failed: %m");
+               return false;
           }
+          submitted += (unsigned)ret;
      }
-     return -1;
+     return true;
 }
 
-void execute_command(char *tokens[], int tokens_count, char *response,
-                     int client_sock) {
-     int command_id = is_valid_command(tokens[0]);
+// Runs a single request; returns its result, or -1 with errno set
+int uring_complete(Uring *ring) {
+     int result;
+     if (!uring_submit_and_wait(ring, &result)) return -1;
+     if (result < 0) {
+          errno = -result;
+          return -1;
+     }
+     return result;
+}
 
-     switch (command_id) {
-          case 0:  // USER
-               if (tokens_count < 2) {
-                    snprintf(
-                        response, BUFFER_SIZE,
-                        "501 Syntax error in parameters or arguments.\r\n");
-               } else {
-                    strncpy(client_session.username, tokens[1],
-                            sizeof(client_session.username) - 1);
-                    snprintf(response, BUFFER_SIZE,
-                             "331 User name okay, need password.\r\n");
-               }
-               break;
-          case 1:  // PASS
-               if (tokens_count < 2) {
-                    snprintf(
-                        response, BUFFER_SIZE,
-                        "501 Syntax error in parameters or arguments.\r\n");
-               } else if (strlen(client_session.username) == 0) {
-                    snprintf(response, BUFFER_SIZE,
-                             "503 Login with USER first.\r\n");
-               } else if (validate_credentials(client_session.username,
-                                               tokens[1])) {
-                    client_session.authenticated = true;
-                    snprintf(response, BUFFER_SIZE,
-                             "230 User logged in, proceed.\r\n");
-               } else {
-                    snprintf(response, BUFFER_SIZE, "530 Not logged in.\r\n");
-               }
-               break;
-          case 3:  // CWD
-               bool allowed = set_path(tokens[1]);
-               if (allowed)
-                    snprintf(response, BUFFER_SIZE, "250 Ok\r\n");
-               else
-                    snprintf(response, BUFFER_SIZE,
-                             "550 Error: Invalid path\r\n");
-               break;
-          case 6:  // QUIT
-               client_session.authenticated = false;
-               memset(client_session.username, 0,
-                      sizeof(client_session.username));
-               snprintf(response, BUFFER_SIZE, "221 Goodbye.\r\n");
-               break;
-          case 9:  // PASV
-          {
-               int pasv_socket = socket(AF_INET, SOCK_STREAM, 0);
-               struct sockaddr_in pasv_addr = {0};
-               pasv_addr.sin_family = AF_INET;
-               pasv_addr.sin_addr.s_addr = INADDR_ANY;
-               pasv_addr.sin_port = 0;  // chosen by OS
-
-               bind(pasv_socket, (struct sockaddr *)&pasv_addr,
-                    sizeof(pasv_addr));
-               listen(pasv_socket, 1);
-
-               socklen_t addr_len = sizeof(pasv_addr);
-               getsockname(pasv_socket, (struct sockaddr *)&pasv_addr,
-                           &addr_len);
-               unsigned int port = ntohs(pasv_addr.sin_port);
-               snprintf(response, BUFFER_SIZE,
-                        "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u).\r\n",
-                        (pasv_addr.sin_addr.s_addr & 0xFF),
-                        (pasv_addr.sin_addr.s_addr >> 8) & 0xFF,
-                        (pasv_addr.sin_addr.s_addr >> 16) & 0xFF,
-                        (pasv_addr.sin_addr.s_addr >> 24) & 0xFF, port >> 8,
-                        port & 0xFF);
-               data_connection.data_socket = pasv_socket;
-               data_connection.active = 0;
-               printf("Server in passive mode on port %u\n", port);
-          } break;
-          case 10:  // TYPE
-               snprintf(response, BUFFER_SIZE, "200 - Command ok \r\n");
-               break;
-          case 13:  // RETR
-               if (tokens_count < 2) {
-                    snprintf(
-                        response, BUFFER_SIZE,
-                        "501 Syntax error in parameters or arguments.\r\n");
-               } else {
-                    int data_sock;
-                    char file_path[BUFFER_SIZE];
-                    char *absolute_path = realpath(current_dir + 1, NULL);
-
-                    snprintf(file_path, sizeof(file_path), "%.900s/%.100s",
-                             absolute_path, tokens[1]);
-
-                    printf("%s\n", file_path);
-
-                    // Check if the file exists and is accessible
-                    FILE *file = fopen(file_path, "rb");
-                    if (!file) {
-                         printf("!file\n");
-                         snprintf(response, BUFFER_SIZE,
-                                  "550 File not found or access denied.\r\n");
-                    } else {
-                         printf("Open a socket for data trnasfer\n");
-                         // Open a socket for data transfer
-                         if (data_connection.active) {
-                              data_sock = socket(AF_INET, SOCK_STREAM, 0);
-                              if (connect(data_sock,
-                                          (struct sockaddr *)&data_connection
-                                              .client_addr,
-                                          sizeof(data_connection.client_addr)) <
-                                  0) {
-                                   printf(
-                                       "Failed to connect to client in active "
-                                       "mode.");
-                                   snprintf(
-                                       response, BUFFER_SIZE,
-                                       "425 Can't open data connection.\r\n");
-                                   fclose(file);
-                                   break;
-                              }
-                              printf("First if all ok\n");
-                         } else {
-                              printf("ELSE\n");
-                              struct sockaddr_in client_data_addr = {0};
-                              socklen_t addr_len = sizeof(client_data_addr);
-                              data_sock =
-                                  accept(data_connection.data_socket,
-                                         (struct sockaddr *)&client_data_addr,
-                                         &addr_len);
-                              if (data_sock < 0) {
-                                   printf(
-                                       "Failed to accept data connection in "
-                                       "passive mode.");
-                                   snprintf(
-                                       response, BUFFER_SIZE,
-                                       "425 Can't open data connection.\r\n");
-                                   fclose(file);
-                                   break;
-                              }
-                              printf("Else all ok\n");
-                         }
-
-                         printf("Sending client 150\n");
-
-                         // Inform client that the transfer is starting
-                         snprintf(response, BUFFER_SIZE,
-                                  "150 Opening data connection for file "
-                                  "transfer.\r\n");
-                         send(client_sock, response, strlen(response), 0);
-
-                         printf("Transfering the file to client\n");
-                         // Transfer the file
-                         char file_buffer[BUFFER_SIZE];
-                         ssize_t bytes_read;
-                         while ((bytes_read = fread(file_buffer, 1, BUFFER_SIZE,
-                                                    file)) > 0) {
-                              send(data_sock, file_buffer, bytes_read, 0);
-                              printf("Sent %ld bytes.\n", bytes_read);
-                         }
-
-                         printf("Transfer finnished\n");
-
-                         fclose(file);
-                         close(data_sock);
-
-                         // Inform client that the transfer is complete
-                         snprintf(response, BUFFER_SIZE,
-                                  "226 Transfer complete.\r\n");
-                    }
-               }
-               break;
-          case 14:  // STOR
-               if (tokens_count < 2) {
-                    snprintf(
-                        response, BUFFER_SIZE,
-                        "501 Syntax error in parameters or arguments.\r\n");
-               } else {
-                    int data_sock;
-                    char file_path[BUFFER_SIZE];
-
-                    char *absolute_path = realpath(current_dir + 1, NULL);
-
-                    // Concatenate the base directory and filename
-                    snprintf(file_path, sizeof(file_path), "%.900s/%.100s",
-                             absolute_path, tokens[1]);
-
-                    printf("%s\n", file_path);
-                    // Check if the directory exists, if not, create it
-                    struct stat st;
-                    if (stat(current_dir, &st) == -1) {
-                         // Directory does not exist, create it
-                         mkdir("server_data", 0755);
-                         mkdir(current_dir, 0755);
-                    }
+// Directory operations go through the ring when the io_uring backend is in
+// use
+int backend_mkdir(int dir_fd, const char *path, mode_t mode) {
+     if (worker_ring == NULL) return mkdirat(dir_fd, path, mode);
 
-                    // Open a socket for data transfer
-                    if (data_connection.active) {
-                         data_sock = socket(AF_INET, SOCK_STREAM, 0);
-                         connect(
-                             data_sock,
-                             (struct sockaddr *)&data_connection.client_addr,
-                             sizeof(data_connection.client_addr));
-                    } else {
-                         struct sockaddr_in client_data_addr = {0};
-                         socklen_t addr_len = sizeof(client_data_addr);
-                         data_sock = accept(
-                             data_connection.data_socket,
-                             (struct sockaddr *)&client_data_addr, &addr_len);
-                    }
+     struct io_uring_sqe *sqe =
+         uring_prepare(worker_ring, IORING_OP_MKDIRAT, dir_fd);
+     sqe->addr = (uint64_t)(uintptr_t)path;
+     sqe->len = mode;
+     return uring_complete(worker_ring) < 0 ? -1 : 0;
+}
 
-                    // Open the file in the specified directory
-                    FILE *file = fopen(file_path, "wb");
-                    if (!file) {
-                         snprintf(response, BUFFER_SIZE,
-                                  "550 Failed to open file.\r\n");
-                    } else {
-                         char file_buffer[BUFFER_SIZE];
-                         ssize_t bytes_received;
-                         while ((bytes_received = recv(data_sock, file_buffer,
-                                                       BUFFER_SIZE, 0)) > 0) {
-                              fwrite(file_buffer, 1, bytes_received, file);
-                              printf("Received %ld bytes.\n", bytes_received);
-                         }
-                         fclose(file);
-                         snprintf(response, BUFFER_SIZE,
-                                  "226 Transfer complete.\r\n");
-                    }
-                    close(data_sock);
-               }
-               break;
-          case 19:  // LIST
-          {
-               DIR *dir;
-               struct dirent *entry;
-               char full_response[BUFFER_SIZE] =
-                   "";  // Buffer to hold all file names
-
-               // Open the current directory
-               char *absolute_path = realpath(current_dir + 1, NULL);
-
-               // dir = opendir(current_dir);
-               dir = opendir(absolute_path);
-               if (dir == NULL) {
-                    perror("LIST error");
-                    snprintf(response, BUFFER_SIZE,
-                             "550 Failed to open directory.\r\n");
-                    break;
-               }
-
-               // Append each file name to the full response buffer
-               while ((entry = readdir(dir)) != NULL) {
-                    if (strcmp(entry->d_name, ".") == 0 ||
-                        strcmp(entry->d_name, "..") == 0) {
-                         continue;
-                    }
+int backend_rmdir(int dir_fd, const char *path) {
+     if (worker_ring == NULL) return unlinkat(dir_fd, path, AT_REMOVEDIR);
 
-                    // Check for buffer overflow
-                    if (strlen(full_response) + strlen(entry->d_name) + 2 >=
-                        BUFFER_SIZE) {
-                         fprintf(stderr,
-                                 "Directory listing too large for buffer.\n");
-                         snprintf(response, BUFFER_SIZE,
-                                  "550 Directory listing too large.\r\n");
-                         closedir(dir);
-                         break;
-                    }
+     struct io_uring_sqe *sqe =
+         uring_prepare(worker_ring, IORING_OP_UNLINKAT, dir_fd);
+     sqe->addr = (uint64_t)(uintptr_t)path;
+     sqe->unlink_flags = AT_REMOVEDIR;
+     return uring_complete(worker_ring) < 0 ? -1 : 0;
+}
 
-                    strncat(full_response, entry->d_name,
-                            BUFFER_SIZE - strlen(full_response) - 1);
-                    strncat(full_response, "\r\n",
-                            BUFFER_SIZE - strlen(full_response) - 1);
-               }
+unsigned hash_key(int kind, const char *key) {
+     unsigned hash = 2166136261u ^ (unsigned)kind;
+     for (; *key != '\0'; key++) {
+          hash = (hash ^ (unsigned char)*key) * 16777619u;
+     }
+     return hash % CACHE_BUCKETS;
+}
 
-               closedir(dir);
+CacheWatch *find_watch(const char *path) {
+     CacheWatch *watch = watches_by_path[hash_key(0, path)];
+     while (watch != NULL && strcmp(watch->path, path) != 0) {
+          watch = watch->next_by_path;
+     }
+     return watch;
+}
 
-               // Send the full directory listing
-               if (strlen(full_response) > 0) {
-                    snprintf(response, BUFFER_SIZE, "%s", full_response);
-               } else {
-                    snprintf(response, BUFFER_SIZE,
-                             "550 Directory is empty.\r\n");
-               }
-          } break;
-
-          case 24:  // HELP
-               snprintf(
-                   response, BUFFER_SIZE,
-                   //"214-The following commands are recognized: \nHELP  CWD  LIST  MKD  STOR\nPASS  PASV  PWD  QUIT  RETR\nRMD\n214 Help OK\r\n");
-             "COMMANDS\nHELP\nUsage: HELP\nDescription: Lists available commands.\nUSER\nUsage: USER <username>\nDescription: Sends the username.\nPASS\nUsage: PASS <password>\nDescription: Sends the password.\nPASV\nUsage: PASV\nDescription: Switches to passive mode for data transfer.\nPWD\nUsage: PWD\nDescription: Displays the current directory.\nCWD\nUsage: CWD <directory>\nDescription: Changes the current directory.\nMKD\nUsage: MKD <directory>\nDescription: Creates a new directory at the current location.\nLIST\nUsage: LIST\nDescription: Lists files and directories in the current directory.\nRMD\nUsage: RMD <directory>\nDescription: Removes the specified directory (must be empty).\nTYPE\nUsage: TYPE <type>\nWarning: Not fully implemented, only supports binary mode.\nDescription: Sets the file transfer type (e.g., ASCII or binary).\nRETR\nUsage: RETR <filename>\nDescription: Downloads the file from the server.\nSTOR\nUsage: STOR <filename>\nDescription: Uploads a file.\nQUIT\nUsage: QUIT\nDescription: Disconnects\r\n");
-          break;
-          case 26:  // PWD
-               snprintf(response, BUFFER_SIZE, "257 \"%.1000s\"\r\n",
-                        current_dir);
-               break;
-          case 27:  // MKD
-               if (tokens_count < 2) {
-                    snprintf(
-                        response, BUFFER_SIZE,
-                        "501 Syntax error in parameters or arguments.\r\n");
-               } else {
-                    char dir_path[BUFFER_SIZE * 2];
-                    char *absolute_path = realpath(current_dir + 1, NULL);
-
-                    snprintf(dir_path, sizeof(dir_path), "%s/%s", absolute_path,
-                             tokens[1]);
-
-                    if (mkdir(dir_path, 0755) == 0) {
-                         snprintf(response, BUFFER_SIZE,
-                                  "257 \"%s\" directory created.\r\n",
-                                  tokens[1]);
-                    } else {
-                         perror("MKD error");
-                         snprintf(response, BUFFER_SIZE,
-                                  "550 Failed to create directory.\r\n");
-                    }
-               }
-               break;
-          case 28:  // RMD
-               if (tokens_count < 2) {
-                    snprintf(
-                        response, BUFFER_SIZE,
-                        "501 Syntax error in parameters or arguments.\r\n");
-               } else {
-                    char dir_path[BUFFER_SIZE * 2];
-                    char *absolute_path = realpath(current_dir + 1, NULL);
-                    snprintf(dir_path, sizeof(dir_path), "%s/%s", absolute_path,
-                             tokens[1]);
-
-                    if (rmdir(dir_path) == 0) {
-                         snprintf(response, BUFFER_SIZE,
-                                  "250 \"%s\" directory removed.\r\n",
-                                  tokens[1]);
-                    } else {
-                         perror("RMD error");
-                         snprintf(response, BUFFER_SIZE,
-                                  "550 Failed to remove directory.\r\n");
-                    }
-               }
-               break;
+CacheWatch *find_watch_wd(int wd) {
+     CacheWatch *watch = watches_by_wd[(unsigned)wd % CACHE_BUCKETS];
+     while (watch != NULL && watch->wd != wd) watch = watch->next_by_wd;
+     return watch;
+}
 
-          default:
-               snprintf(response, BUFFER_SIZE,
-                        "502 Command: %s not implemented \r\n",
-                        valid_commands[command_id]);
-               break;
-     }
+void remove_watch(CacheWatch *watch) {
+     CacheWatch **link = &watches_by_wd[(unsigned)watch->wd % CACHE_BUCKETS];
+     while (*link != watch) link = &(*link)->next_by_wd;
+     *link = watch->next_by_wd;
+     link = &watches_by_path[hash_key(0, watch->path)];
+     while (*link != watch) link = &(*link)->next_by_path;
+     *link = watch->next_by_path;
+     link = &all_watches;
+     while (*link != watch) link = &(*link)->next_all;
+     *link = watch->next_all;
+
+     inotify_rm_watch(inotify_fd, watch->wd);
+     free(watch->path);
+     free(watch);
 }
 
-void handle_client(int client_sock) {
-     char buffer[BUFFER_SIZE];
-     char response[BUFFER_SIZE];
-     char *tokens[MAX_ARGUMENTS];
-     int tokens_count = 0;
+bool is_below(const char *path, const char *dir, size_t dir_len) {
+     return strncmp(path, dir, dir_len) == 0 &&
+            (path[dir_len] == '\0' || path[dir_len] == '/');
+}
 
-     //snprintf(response, BUFFER_SIZE, "220 FTP Server Ready\r\n");
-     snprintf(response, BUFFER_SIZE, "220 FTP Server Ready\nRun HELP for all available commands\n\nWARNING!\n--------\nFiles:\nServer must have a directory named server_data placed inside the same directory(it might not be created by the server automatically).\nClient must have a directory named data placed inside the same directory.\nUsers:\nA user is automatically logged in as anonymous, once they connect.\nUsers are: user1 (password1) / user2 (password2)\nAll users (even anonymous) are allowed in server_data/public and all its subdirectories\nOnce a user has logged in, they can access server_data/<username> as well as server_data/public.\nUsers are not allowed to go back to root (/server_data) once they have entered a subdirectory(/public || /<username>\r\n");
-     send(client_sock, response, strlen(response), 0);
+// Length of the next longer prefix of dir that names a directory, starting
+// below the cache root
+size_t next_component(const char *dir, size_t len) {
+     if (dir[len] == '\0') return 0;
+     const char *slash = strchr(dir + len + 1, '/');
+     return slash != NULL ? (size_t)(slash - dir) : strlen(dir);
+}
 
-     strncpy(current_dir, ROOT_DIR, BUFFER_SIZE);
+// Watches every directory from the cache root down to dir, since a change
+// in any of them can change what a path below resolves to. Fails for paths
+// outside the root or when inotify runs out of watches.
+bool watch_directories(const char *dir) {
+     size_t len = strlen(cache_root);
+     if (!is_below(dir, cache_root, len)) return false;
 
-     while (1) {
-          ssize_t len = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-          if (len <= 0) {
-               perror("Connection closed or error on receiving!\n");
-               break;
-          }
+     char path[PATH_MAX];
+     for (; len > 0; len = next_component(dir, len)) {
+          memcpy(path, dir, len);
+          path[len] = '\0';
+          if (find_watch(path) != NULL) continue;
 
-          buffer[len - 2] = '\0';  // eliminate /r/n and end string
-          split_client_input(buffer, tokens, &tokens_count);
+          int wd = inotify_add_watch(inotify_fd, path, CACHE_WATCH_MASK);
+          if (wd < 0) return false;
+          // A directory renamed back to a watched path keeps its watch
+          CacheWatch *watch = find_watch_wd(wd);
+          if (watch != NULL) remove_watch(watch);
+          wd = inotify_add_watch(inotify_fd, path, CACHE_WATCH_MASK);
+          if (wd < 0 || (watch = calloc(1, sizeof(CacheWatch))) == NULL) {
+               return false;
+          }
 
-          for (int i = 0; i < tokens_count; i++) {
-               printf("Token[%d]: %s\n", i, tokens[i]);
+          watch->wd = wd;
+          watch->path = strdup(path);
+          if (watch->path == NULL) {
+               free(watch);
+               return false;
           }
-          printf("\n");
+          watch->changed = ++cache_clock;
+          watch->next_by_wd = watches_by_wd[(unsigned)wd % CACHE_BUCKETS];
+          watches_by_wd[(unsigned)wd % CACHE_BUCKETS] = watch;
+          watch->next_by_path = watches_by_path[hash_key(0, path)];
+          watches_by_path[hash_key(0, path)] = watch;
+          watch->next_all = all_watches;
+          all_watches = watch;
+     }
+     return true;
+}
 
-          if (tokens_count > 0 && is_valid_command(tokens[0]) > -1)
-               execute_command(tokens, tokens_count, response, client_sock);
-          else
-               snprintf(response, BUFFER_SIZE, "500 Invalid command!\r\n");
+// True if no directory from the cache root down to dir changed since the
+// cache clock read start
+bool unchanged_since(const char *dir, unsigned long start) {
+     size_t len = strlen(cache_root);
+     if (start == 0 || cache_flushed >= start ||
+         !is_below(dir, cache_root, len)) {
+          return false;
+     }
 
-          send(client_sock, response, strlen(response), 0);
+     char path[PATH_MAX];
+     for (; len > 0; len = next_component(dir, len)) {
+          memcpy(path, dir, len);
+          path[len] = '\0';
+          CacheWatch *watch = find_watch(path);
+          if (watch == NULL || watch->changed >= start) return false;
      }
+     return true;
+}
 
-     close(client_sock);
+void release_blob(CacheBlob *blob) {
+     if (blob != NULL && atomic_fetch_sub(&blob->refs, 1) == 1) free(blob);
 }
 
-void ftp_server() {
-     int server_fd, client_sock;
-     struct sockaddr_in server_addr, client_addr;
-     socklen_t addr_len = sizeof(client_addr);
+void cache_unlink(CacheEntry *entry) {
+     CacheEntry **link = &cache_table[hash_key(entry->kind, entry->key)];
+     while (*link != entry) link = &(*link)->next;
+     *link = entry->next;
 
-     server_fd = socket(AF_INET, SOCK_STREAM, 0);
-     if (server_fd < 0) {
-          perror("Socket creation failed\n");
-          return;
+     if (entry->lru_prev != NULL) {
+          entry->lru_prev->lru_next = entry->lru_next;
+     } else {
+          cache_lru_head = entry->lru_next;
+     }
+     if (entry->lru_next != NULL) {
+          entry->lru_next->lru_prev = entry->lru_prev;
+     } else {
+          cache_lru_tail = entry->lru_prev;
      }
 
-     server_addr.sin_family = AF_INET;
-     server_addr.sin_addr.s_addr = INADDR_ANY;
-     server_addr.sin_port = htons(FTP_PORT);
-     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
-         0) {
-          perror("Bind failed\n");
-          close(server_fd);
-          return;
+     cache_entries--;
+     cache_bytes -= entry->bytes;
+     release_blob(entry->listing);
+     free(entry->key);
+     free(entry->resolved);
+     free(entry);
+}
+
+void cache_push_front(CacheEntry *entry) {
+     entry->lru_prev = NULL;
+     entry->lru_next = cache_lru_head;
+     if (cache_lru_head != NULL) cache_lru_head->lru_prev = entry;
+     cache_lru_head = entry;
+     if (cache_lru_tail == NULL) cache_lru_tail = entry;
+}
+
+CacheEntry *cache_find(int kind, const char *key) {
+     CacheEntry *entry = cache_table[hash_key(kind, key)];
+     while (entry != NULL &&
+            (entry->kind != kind || strcmp(entry->key, key) != 0)) {
+          entry = entry->next;
      }
+     if (entry == NULL || entry == cache_lru_head) return entry;
 
-     if (listen(server_fd, 5) < 0) {
-          perror("Listen failed\n");
-          return;
+     // Move to the front of the LRU list
+     entry->lru_prev->lru_next = entry->lru_next;
+     if (entry->lru_next != NULL) {
+          entry->lru_next->lru_prev = entry->lru_prev;
+     } else {
+          cache_lru_tail = entry->lru_prev;
      }
+     cache_push_front(entry);
+     return entry;
+}
 
-     printf("FTP Server started on port %d...\n", FTP_PORT);
+// Takes over the entry, replacing one with the same key, and evicts the
+// least recently used entries beyond the limits
+void cache_insert(CacheEntry *entry) {
+     CacheEntry *old = cache_find(entry->kind, entry->key);
+     if (old != NULL) cache_unlink(old);
 
-     while (1) {
-          client_sock =
-              accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
-          if (client_sock < 0) {
-               perror("Accept failed\n");
-               continue;
+     unsigned bucket = hash_key(entry->kind, entry->key);
+     entry->next = cache_table[bucket];
+     cache_table[bucket] = entry;
+     cache_push_front(entry);
+     cache_entries++;
+     cache_bytes += entry->bytes;
+
+     while (cache_lru_tail != entry && (cache_entries > CACHE_MAX_ENTRIES ||
+                                        cache_bytes > CACHE_MAX_BYTES)) {
+          cache_unlink(cache_lru_tail);
+     }
+}
+
+CacheEntry *new_cache_entry(int kind, const char *key, const char *resolved,
+                            size_t size) {
+     CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+     if (entry == NULL) return NULL;
+     entry->kind = kind;
+     entry->key = strdup(key);
+     entry->resolved = strdup(resolved);
+     entry->bytes = sizeof(CacheEntry) + strlen(key) + strlen(resolved) + size;
+     return entry;
+}
+
+// Drops everything cached for path or below it, and the listing and
+// attributes of the directory holding it. Watches below path are dropped
+// too, since the directories they watch may have moved away.
+void invalidate_locked(const char *path) {
+     char parent[PATH_MAX];
+     snprintf(parent, sizeof(parent), "%s", path);
+     char *slash = strrchr(parent, '/');
+     if (slash != NULL) *slash = '\0';
+     size_t len = strlen(path);
+
+     CacheEntry *entry = cache_lru_head;
+     while (entry != NULL) {
+          CacheEntry *next = entry->lru_next;
+          if (is_below(entry->resolved, path, len) ||
+              strcmp(entry->resolved, parent) == 0) {
+               cache_unlink(entry);
           }
+          entry = next;
+     }
 
-          char client_ip[INET_ADDRSTRLEN];
-          inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-          printf("New client connected from %s:%d\n", client_ip,
-                 ntohs(client_addr.sin_port));
+     CacheWatch *watch = all_watches;
+     while (watch != NULL) {
+          CacheWatch *next = watch->next_all;
+          if (is_below(watch->path, path, len)) remove_watch(watch);
+          watch = next;
+     }
+     if ((watch = find_watch(parent)) != NULL) watch->changed = ++cache_clock;
+}
+
+// Called for changes made by this server, which must be visible to the
+// next command right away rather than once inotify reports them
+void cache_invalidate(const char *path) {
+     if (inotify_fd < 0) return;
+     pthread_mutex_lock(&cache_lock);
+     invalidate_locked(path);
+     pthread_mutex_unlock(&cache_lock);
+}
+
+// Same for a path relative to the session directory
+void invalidate_session_path(Session *session, const char *path) {
+     char full_path[PATH_MAX + BUFFER_SIZE];
+     snprintf(full_path, sizeof(full_path), "%s/%s", session->dir_path, path);
+     cache_invalidate(full_path);
+}
+
+// Returns a reference to the cached listing of dir, or NULL. On a miss
+// *start receives the clock to hand to cache_store_listing, 0 if the
+// listing cannot be cached.
+CacheBlob *cache_get_listing(const char *dir, int command,
+                             unsigned long *start) {
+     *start = 0;
+     if (inotify_fd < 0) return NULL;
 
-          handle_client(client_sock);
+     pthread_mutex_lock(&cache_lock);
+     CacheEntry *entry = cache_find(command, dir);
+     if (entry != NULL) {
+          CacheBlob *blob = entry->listing;
+          atomic_fetch_add(&blob->refs, 1);
+          pthread_mutex_unlock(&cache_lock);
+          metrics_add(cache_hits, 1);
+          return blob;
      }
+     metrics_add(cache_misses, 1);
+     // The watches must be in place before the directory is read
+     if (watch_directories(dir)) *start = cache_clock + 1;
+     pthread_mutex_unlock(&cache_lock);
+     return NULL;
+}
 
-     close(server_fd);
+// Takes over a complete listing read since start
+void cache_store_listing(const char *dir, int command, unsigned long start,
+                         CacheBlob *blob) {
+     pthread_mutex_lock(&cache_lock);
+     CacheEntry *entry = NULL;
+     if (unchanged_since(dir, start)) {
+          entry = new_cache_entry(command, dir, dir, blob->capacity);
+     }
+     if (entry != NULL) {
+          entry->listing = blob;
+          cache_insert(entry);
+     } else {
+          free(blob);
+     }
+     pthread_mutex_unlock(&cache_lock);
 }
 
-int main() {
-     ftp_server();
-     return 0;
+// Main thread: drops whatever the reported changes affect
+void handle_cache_events() {
+     char buffer[4096]
+         __attribute__((aligned(__alignof__(struct inotify_event))));
+     ssize_t len;
+
+     while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+          pthread_mutex_lock(&cache_lock);
+          for (char *p = buffer; p < buffer + len;) {
+               struct inotify_event *event = (struct inotify_event *)p;
+               p += sizeof(struct inotify_event) + event->len;
+
+               if (event->mask & IN_Q_OVERFLOW) {
+                    // Events were lost, nothing cached can be trusted
+                    while (cache_lru_head != NULL) {
+                         cache_unlink(cache_lru_head);
+                    }
+                    cache_flushed = ++cache_clock;
+                    continue;
+               }
+
+               CacheWatch *watch = find_watch_wd(event->wd);
+               if (watch == NULL) continue;
+               if (event->len > 0) {
+                    char path[PATH_MAX];
+                    snprintf(path, sizeof(path), "%s/%s", watch->path,
+                             event->name);
+                    invalidate_locked(path);
+               } else {
+                    // The directory itself was moved, removed or changed
+                    invalidate_locked(watch->path);
+               }
+          }
+          pthread_mutex_unlock(&cache_lock);
+     }
+}
+
+// Where an open descriptor really is, used to key the listing cache
+void descriptor_path(int fd, char *path, size_t size) {
+     char link[64];
+     snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+     ssize_t len = readlink(link, path, size - 1);
+     path[len > 0 ? len : 0] = '\0';
+}
+
+void cache_init() {
+     descriptor_path(root_fd, cache_root, sizeof(cache_root));
+     if (cache_root[0] != '/') {
+          log_warn("Metadata cache disabled: /proc is not mounted");
+          return;
+     }
+     inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+     if (inotify_fd < 0) log_warn("Metadata cache disabled: %m");
+}
+
+unsigned file_cache_bucket(dev_t dev, ino_t ino) {
+     uint64_t hash = ((uint64_t)dev * 0x9E3779B97F4A7C15ull) ^ (uint64_t)ino;
+     return (unsigned)((hash * 0x9E3779B97F4A7C15ull) >> 32) %
+            FILE_CACHE_BUCKETS;
+}
+
+void file_cache_unlink(FileCacheEntry *entry) {
+     FileCacheEntry **link =
+         &file_cache_table[file_cache_bucket(entry->dev, entry->ino)];
+     while (*link != entry) link = &(*link)->next;
+     *link = entry->next;
+
+     if (entry->lru_prev != NULL) {
+          entry->lru_prev->lru_next = entry->lru_next;
+     } else {
+          file_cache_lru_head = entry->lru_next;
+     }
+     if (entry->lru_next != NULL) {
+          entry->lru_next->lru_prev = entry->lru_prev;
+     } else {
+          file_cache_lru_tail = entry->lru_prev;
+     }
+
+     file_cache_bytes -= sizeof(FileCacheEntry) + entry->contents->capacity;
+     release_blob(entry->contents);
+     free(entry);
+}
+
+void file_cache_push_front(FileCacheEntry *entry) {
+     entry->lru_prev = NULL;
+     entry->lru_next = file_cache_lru_head;
+     if (file_cache_lru_head != NULL) file_cache_lru_head->lru_prev = entry;
+     file_cache_lru_head = entry;
+     if (file_cache_lru_tail == NULL) file_cache_lru_tail = entry;
+}
+
+// Called with file_cache_lock held
+FileCacheEntry *file_cache_find(dev_t dev, ino_t ino) {
+     FileCacheEntry *entry = file_cache_table[file_cache_bucket(dev, ino)];
+     while (entry != NULL && (entry->dev != dev || entry->ino != ino)) {
+          entry = entry->next;
+     }
+     return entry;
+}
+
+bool same_version(FileCacheEntry *entry, const struct stat *st) {
+     return entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+            entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+            (off_t)entry->contents->len == st->st_size;
+}
+
+// Returns a reference to the cached contents of the open file fd, whose
+// attributes are st, reading them into the cache on a miss. NULL if the
+// file is not cached and cannot be.
+CacheBlob *file_cache_get(int fd, const struct stat *st) {
+     if (!S_ISREG(st->st_mode) || st->st_size > FILE_CACHE_MAX_FILE ||
+         (size_t)st->st_size > file_cache_limit) {
+          return NULL;
+     }
+
+     pthread_mutex_lock(&file_cache_lock);
+     FileCacheEntry *entry = file_cache_find(st->st_dev, st->st_ino);
+     if (entry != NULL && same_version(entry, st)) {
+          if (entry != file_cache_lru_head) {
+               entry->lru_prev->lru_next = entry->lru_next;
+               if (entry->lru_next != NULL) {
+                    entry->lru_next->lru_prev = entry->lru_prev;
+               } else {
+                    file_cache_lru_tail = entry->lru_prev;
+               }
+               file_cache_push_front(entry);
+          }
+          CacheBlob *blob = entry->contents;
+          atomic_fetch_add(&blob->refs, 1);
+          pthread_mutex_unlock(&file_cache_lock);
+          metrics_add(file_cache_hits, 1);
+          return blob;
+     }
+     // The file changed since it was cached
+     if (entry != NULL) file_cache_unlink(entry);
+     pthread_mutex_unlock(&file_cache_lock);
+     metrics_add(file_cache_misses, 1);
+
+     size_t size = (size_t)st->st_size;
+     CacheBlob *blob = malloc(sizeof(CacheBlob) + size);
+     entry = malloc(sizeof(FileCacheEntry));
+     if (blob == NULL || entry == NULL) {
+          free(blob);
+          free(entry);
+          return NULL;
+     }
+     atomic_init(&blob->refs, 2);  // the cache and the caller
+     blob->len = 0;
+     blob->capacity = size;
+     while (blob->len < size) {
+          ssize_t bytes_read = pread(fd, blob->data + blob->len,
+                                     size - blob->len, (off_t)blob->len);
+          if (bytes_read <= 0) break;
+          blob->len += (size_t)bytes_read;
+     }
+     // A file written to while it was read is sent from disk instead
+     struct stat after;
+     if (blob->len != size || fstat(fd, &after) < 0 ||
+         after.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+         after.st_mtim.tv_nsec != st->st_mtim.tv_nsec ||
+         after.st_size != st->st_size) {
+          free(blob);
+          free(entry);
+          return NULL;
+     }
+
+     entry->dev = st->st_dev;
+     entry->ino = st->st_ino;
+     entry->mtime = st->st_mtim;
+     entry->contents = blob;
+     pthread_mutex_lock(&file_cache_lock);
+     // Another session may have read the same file meanwhile
+     FileCacheEntry *old = file_cache_find(st->st_dev, st->st_ino);
+     if (old != NULL) file_cache_unlink(old);
+     unsigned bucket = file_cache_bucket(st->st_dev, st->st_ino);
+     entry->next = file_cache_table[bucket];
+     file_cache_table[bucket] = entry;
+     file_cache_push_front(entry);
+     file_cache_bytes += sizeof(FileCacheEntry) + size;
+     while (file_cache_lru_tail != entry &&
+            file_cache_bytes > file_cache_limit) {
+          file_cache_unlink(file_cache_lru_tail);
+          metrics_add(file_cache_evictions, 1);
+     }
+     pthread_mutex_unlock(&file_cache_lock);
+     return blob;
+}
+
+// Drops the cached contents of the open file fd. STOR calls it before and
+// after writing, since writes within one tick of the clock leave the
+// modification time as it was.
+void file_cache_forget(int fd) {
+     struct stat st;
+     if (file_cache_limit == 0 || fstat(fd, &st) < 0) return;
+     pthread_mutex_lock(&file_cache_lock);
+     FileCacheEntry *entry = file_cache_find(st.st_dev, st.st_ino);
+     if (entry != NULL) file_cache_unlink(entry);
+     pthread_mutex_unlock(&file_cache_lock);
+}
+
+
+// Tokenizes in place, so the tokens stay valid for as long as the input does
+void split_client_input(char *input, char *tokens[], int *token_count) {
+     *token_count = 0;
+
+     char *save_ptr;
+     char *token = strtok_r(input, " ", &save_ptr);
+     while (token != NULL && *token_count < MAX_ARGUMENTS) {
+          tokens[*token_count] = token;
+          (*token_count)++;
+          token = strtok_r(NULL, " ", &save_ptr);
+     }
+}
+
+// Parses a whole non-negative decimal argument, -1 if it is not one
+long long parse_size(const char *text) {
+     char *end = NULL;
+     errno = 0;
+     long long value = strtoll(text, &end, 10);
+     if (end == text || *end != '\0' || errno == ERANGE) return -1;
+     return value;
+}
+
+// SHA-256 (FIPS 180-4), for the password hashes
+typedef struct {
+     uint32_t state[8];
+     uint64_t length;  // bytes hashed so far
+     unsigned char block[64];
+     size_t block_len;
+} Sha256;
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(Sha256 *sha) {
+     static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                         0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                         0x1f83d9ab, 0x5be0cd19};
+     memcpy(sha->state, initial, sizeof(initial));
+     sha->length = 0;
+     sha->block_len = 0;
+}
+
+void sha256_compress(uint32_t state[8], const unsigned char block[64]) {
+     uint32_t w[64];
+     for (int i = 0; i < 16; i++) {
+          const unsigned char *word = block + i * 4;
+          w[i] = (uint32_t)word[0] << 24 | (uint32_t)word[1] << 16 |
+                 (uint32_t)word[2] << 8 | word[3];
+     }
+     for (int i = 16; i < 64; i++) {
+          uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^
+                        (w[i - 15] >> 3);
+          uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^
+                        (w[i - 2] >> 10);
+          w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+     }
+
+     uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+     uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+     for (int i = 0; i < 64; i++) {
+          uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                        ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+          uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                        ((a & b) ^ (a & c) ^ (b & c));
+          h = g;
+          g = f;
+          f = e;
+          e = d + t1;
+          d = c;
+          c = b;
+          b = a;
+          a = t1 + t2;
+     }
+     state[0] += a;
+     state[1] += b;
+     state[2] += c;
+     state[3] += d;
+     state[4] += e;
+     state[5] += f;
+     state[6] += g;
+     state[7] += h;
+}
+
+#ifdef __x86_64__
+// SHA extensions: each group of four rounds is two sha256rnds2, and the
+// message schedule runs four words at a time
+__attribute__((target("sha,sse4.1"))) void sha256_blocks_ni(
+    uint32_t state[8], const unsigned char *data, size_t blocks) {
+     const __m128i byte_swap =
+         _mm_set_epi64x(0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+     // The instructions want the state as ABEF and CDGH
+     __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)state), 0xB1);
+     __m128i state1 =
+         _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)(state + 4)), 0x1B);
+     __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+     state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+     for (; blocks > 0; blocks--, data += 64) {
+          __m128i saved0 = state0, saved1 = state1;
+          __m128i w[4];
+          for (int group = 0; group < 16; group++) {
+               __m128i *word = &w[group % 4];
+               if (group < 4) {
+                    *word = _mm_shuffle_epi8(
+                        _mm_loadu_si128((__m128i *)(data + group * 16)),
+                        byte_swap);
+               } else {
+                    __m128i next =
+                        _mm_sha256msg1_epu32(*word, w[(group + 1) % 4]);
+                    next = _mm_add_epi32(
+                        next, _mm_alignr_epi8(w[(group + 3) % 4],
+                                              w[(group + 2) % 4], 4));
+                    *word = _mm_sha256msg2_epu32(next, w[(group + 3) % 4]);
+               }
+               __m128i message = _mm_add_epi32(
+                   *word, _mm_loadu_si128((__m128i *)(sha256_k + group * 4)));
+               state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+               message = _mm_shuffle_epi32(message, 0x0E);
+               state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+          }
+          state0 = _mm_add_epi32(state0, saved0);
+          state1 = _mm_add_epi32(state1, saved1);
+     }
+
+     tmp = _mm_shuffle_epi32(state0, 0x1B);
+     state1 = _mm_shuffle_epi32(state1, 0xB1);
+     _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(tmp, state1, 0xF0));
+     _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+void sha256_blocks(uint32_t state[8], const unsigned char *data,
+                   size_t blocks) {
+#ifdef __x86_64__
+     if (__builtin_cpu_supports("sha")) {
+          sha256_blocks_ni(state, data, blocks);
+          return;
+     }
+#endif
+     for (; blocks > 0; blocks--, data += 64) sha256_compress(state, data);
+}
+
+void sha256_update(Sha256 *sha, const void *data, size_t len) {
+     const unsigned char *bytes = data;
+     sha->length += len;
+     while (len > 0) {
+          if (sha->block_len == 0 && len >= 64) {
+               sha256_blocks(sha->state, bytes, len / 64);
+               bytes += len / 64 * 64;
+               len %= 64;
+               continue;
+          }
+          size_t take = 64 - sha->block_len < len ? 64 - sha->block_len : len;
+          memcpy(sha->block + sha->block_len, bytes, take);
+          sha->block_len += take;
+          bytes += take;
+          len -= take;
+          if (sha->block_len == 64) {
+               sha256_blocks(sha->state, sha->block, 1);
+               sha->block_len = 0;
+          }
+     }
+}
+
+void sha256_final(Sha256 *sha, unsigned char digest[32]) {
+     uint64_t bits = sha->length * 8;
+     sha->block[sha->block_len++] = 0x80;
+     if (sha->block_len > 56) {
+          memset(sha->block + sha->block_len, 0, 64 - sha->block_len);
+          sha256_blocks(sha->state, sha->block, 1);
+          sha->block_len = 0;
+     }
+     memset(sha->block + sha->block_len, 0, 56 - sha->block_len);
+     for (int i = 0; i < 8; i++) {
+          sha->block[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+     }
+     sha256_blocks(sha->state, sha->block, 1);
+     for (int i = 0; i < 8; i++) {
+          digest[i * 4] = (unsigned char)(sha->state[i] >> 24);
+          digest[i * 4 + 1] = (unsigned char)(sha->state[i] >> 16);
+          digest[i * 4 + 2] = (unsigned char)(sha->state[i] >> 8);
+          digest[i * 4 + 3] = (unsigned char)sha->state[i];
+     }
+}
+
+// PBKDF2-HMAC-SHA256 with a 32-byte result, one block. The inner and outer
+// states of the key are computed once instead of on every iteration.
+void pbkdf2_sha256(const char *password, const unsigned char *salt,
+                   size_t salt_len, unsigned iterations,
+                   unsigned char out[32]) {
+     unsigned char key[64] = {0};
+     size_t key_len = strlen(password);
+     if (key_len > sizeof(key)) {
+          Sha256 sha;
+          sha256_init(&sha);
+          sha256_update(&sha, password, key_len);
+          sha256_final(&sha, key);
+     } else {
+          memcpy(key, password, key_len);
+     }
+     unsigned char pad[64];
+     Sha256 inner, outer;
+     for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+     sha256_init(&inner);
+     sha256_update(&inner, pad, 64);
+     for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+     sha256_init(&outer);
+     sha256_update(&outer, pad, 64);
+
+     unsigned char u[32];
+     Sha256 sha = inner;
+     sha256_update(&sha, salt, salt_len);
+     sha256_update(&sha, "\0\0\0\1", 4);  // block index
+     sha256_final(&sha, u);
+     sha = outer;
+     sha256_update(&sha, u, 32);
+     sha256_final(&sha, u);
+     memcpy(out, u, 32);
+     for (unsigned n = 1; n < iterations; n++) {
+          sha = inner;
+          sha256_update(&sha, u, 32);
+          sha256_final(&sha, u);
+          sha = outer;
+          sha256_update(&sha, u, 32);
+          sha256_final(&sha, u);
+          for (int i = 0; i < 32; i++) out[i] ^= u[i];
+     }
+}
+
+// CRC-32C (Castagnoli), reflected, one table for CPUs without SSE4.2
+uint32_t crc32c_table[256];
+pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+void build_crc32c_table() {
+     for (uint32_t i = 0; i < 256; i++) {
+          uint32_t crc = i;
+          for (int bit = 0; bit < 8; bit++) {
+               crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+          }
+          crc32c_table[i] = crc;
+     }
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(
+    uint32_t crc, const unsigned char *data, size_t len) {
+     uint64_t crc64 = crc;
+     for (; len >= 8; len -= 8, data += 8) {
+          uint64_t word;
+          memcpy(&word, data, sizeof(word));
+          crc64 = _mm_crc32_u64(crc64, word);
+     }
+     crc = (uint32_t)crc64;
+     for (; len > 0; len--) crc = _mm_crc32_u8(crc, *data++);
+     return crc;
+}
+#endif
+
+// Continues crc, which starts out as ~0 and is inverted at the end
+uint32_t crc32c_update(uint32_t crc, const unsigned char *data, size_t len) {
+#ifdef __x86_64__
+     if (__builtin_cpu_supports("sse4.2")) {
+          return crc32c_sse42(crc, data, len);
+     }
+#endif
+     pthread_once(&crc32c_table_once, build_crc32c_table);
+     for (; len > 0; len--) {
+          crc = (crc >> 8) ^ crc32c_table[(crc ^ *data++) & 0xFF];
+     }
+     return crc;
+}
+
+// XXH64 with seed 0, fed in pieces of any size
+#define XXH_PRIME1 11400714785074694791ull
+#define XXH_PRIME2 14029467366897019727ull
+#define XXH_PRIME3 1609587929392839161ull
+#define XXH_PRIME4 9650029242287828579ull
+#define XXH_PRIME5 2870177450012600261ull
+
+typedef struct {
+     uint64_t lanes[4];
+     uint64_t length;
+     unsigned char stripe[32];
+     size_t stripe_len;
+} Xxh64;
+
+uint64_t rotl64(uint64_t value, int bits) {
+     return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t read64(const unsigned char *bytes) {
+     uint64_t value;
+     memcpy(&value, bytes, sizeof(value));
+     return value;  // little endian, like every Linux target of this server
+}
+
+uint64_t xxh64_round(uint64_t lane, uint64_t input) {
+     return rotl64(lane + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+void xxh64_init(Xxh64 *xxh) {
+     xxh->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+     xxh->lanes[1] = XXH_PRIME2;
+     xxh->lanes[2] = 0;
+     xxh->lanes[3] = -XXH_PRIME1;
+     xxh->length = 0;
+     xxh->stripe_len = 0;
+}
+
+void xxh64_stripe(Xxh64 *xxh, const unsigned char *stripe) {
+     for (int i = 0; i < 4; i++) {
+          xxh->lanes[i] = xxh64_round(xxh->lanes[i], read64(stripe + i * 8));
+     }
+}
+
+void xxh64_update(Xxh64 *xxh, const unsigned char *data, size_t len) {
+     xxh->length += len;
+     if (xxh->stripe_len > 0) {
+          size_t take = 32 - xxh->stripe_len < len ? 32 - xxh->stripe_len : len;
+          memcpy(xxh->stripe + xxh->stripe_len, data, take);
+          xxh->stripe_len += take;
+          data += take;
+          len -= take;
+          if (xxh->stripe_len < 32) return;
+          xxh64_stripe(xxh, xxh->stripe);
+          xxh->stripe_len = 0;
+     }
+     for (; len >= 32; len -= 32, data += 32) xxh64_stripe(xxh, data);
+     memcpy(xxh->stripe, data, len);
+     xxh->stripe_len = len;
+}
+
+uint64_t xxh64_final(Xxh64 *xxh) {
+     uint64_t hash;
+     if (xxh->length >= 32) {
+          uint64_t *lanes = xxh->lanes;
+          hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) +
+                 rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+          for (int i = 0; i < 4; i++) {
+               hash ^= xxh64_round(0, lanes[i]);
+               hash = hash * XXH_PRIME1 + XXH_PRIME4;
+          }
+     } else {
+          hash = XXH_PRIME5;
+     }
+     hash += xxh->length;
+
+     const unsigned char *tail = xxh->stripe;
+     size_t len = xxh->stripe_len;
+     for (; len >= 8; len -= 8, tail += 8) {
+          hash ^= xxh64_round(0, read64(tail));
+          hash = rotl64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+     }
+     if (len >= 4) {
+          uint32_t word;
+          memcpy(&word, tail, sizeof(word));
+          hash ^= word * XXH_PRIME1;
+          hash = rotl64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+          len -= 4;
+          tail += 4;
+     }
+     for (; len > 0; len--) {
+          hash ^= *tail++ * XXH_PRIME5;
+          hash = rotl64(hash, 11) * XXH_PRIME1;
+     }
+     hash ^= hash >> 33;
+     hash *= XXH_PRIME2;
+     hash ^= hash >> 29;
+     hash *= XXH_PRIME3;
+     hash ^= hash >> 32;
+     return hash;
+}
+
+// The algorithms of HASH, in the order of HashAlgorithm
+const char *hash_names[NUM_HASH_ALGORITHMS] = {"SHA-256", "CRC32C", "XXH64"};
+// Their extended attributes, below DIGEST_XATTR_PREFIX
+const char *hash_attributes[NUM_HASH_ALGORITHMS] = {"sha256", "crc32c",
+                                                    "xxh64"};
+
+typedef struct {
+     HashAlgorithm algorithm;
+     union {
+          uint32_t crc;
+          Xxh64 xxh;
+          Sha256 sha;
+     };
+} Digest;
+
+void digest_init(Digest *digest, HashAlgorithm algorithm) {
+     digest->algorithm = algorithm;
+     if (algorithm == HASH_CRC32C) {
+          digest->crc = ~0u;
+     } else if (algorithm == HASH_XXH64) {
+          xxh64_init(&digest->xxh);
+     } else {
+          sha256_init(&digest->sha);
+     }
+}
+
+void digest_update(Digest *digest, const void *data, size_t len) {
+     if (digest->algorithm == HASH_CRC32C) {
+          digest->crc = crc32c_update(digest->crc, data, len);
+     } else if (digest->algorithm == HASH_XXH64) {
+          xxh64_update(&digest->xxh, data, len);
+     } else {
+          sha256_update(&digest->sha, data, len);
+     }
+}
+
+// Writes the digest in lower-case hex, big endian like the usual tools
+void digest_final(Digest *digest, char hex[DIGEST_HEX_SIZE]) {
+     if (digest->algorithm == HASH_CRC32C) {
+          snprintf(hex, DIGEST_HEX_SIZE, "%08x", ~digest->crc);
+     } else if (digest->algorithm == HASH_XXH64) {
+          snprintf(hex, DIGEST_HEX_SIZE, "%016llx",
+                   (unsigned long long)xxh64_final(&digest->xxh));
+     } else {
+          unsigned char sum[32];
+          sha256_final(&digest->sha, sum);
+          for (int i = 0; i < 32; i++) {
+               snprintf(hex + i * 2, DIGEST_HEX_SIZE - (size_t)i * 2, "%02x",
+                        sum[i]);
+          }
+     }
+}
+
+// HASH or XCRC reading a file whose digest is not stored
+struct DigestJob {
+     Digest digest;
+     struct stat st;  // of the file when reading started
+     off_t offset;
+     int command;
+     char name[BUFFER_SIZE];
+     unsigned char buffer[DIGEST_READ_SIZE];
+};
+
+// The value of a digest attribute is "<mtime> <size> <digest>", this is
+// all but the digest
+int digest_version(const struct stat *st, char *version, size_t size) {
+     return snprintf(version, size, "%lld.%09ld %lld ",
+                     (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+                     (long long)st->st_size);
+}
+
+// The digest stored for the open file fd, whose attributes are st, if the
+// file still has the modification time and size it was computed for
+bool stored_digest(int fd, const struct stat *st, HashAlgorithm algorithm,
+                   char hex[DIGEST_HEX_SIZE]) {
+     char attribute[32];
+     snprintf(attribute, sizeof(attribute), "%s%s", DIGEST_XATTR_PREFIX,
+              hash_attributes[algorithm]);
+     char version[64];
+     int version_len = digest_version(st, version, sizeof(version));
+     char stored[sizeof(version) + DIGEST_HEX_SIZE];
+     ssize_t len = fgetxattr(fd, attribute, stored, sizeof(stored) - 1);
+     if (len <= version_len || memcmp(stored, version, version_len) != 0) {
+          return false;
+     }
+     stored[len] = '\0';
+     snprintf(hex, DIGEST_HEX_SIZE, "%s", stored + version_len);
+     return true;
+}
+
+// Keeps the digest of the length bytes read from fd for the next query.
+// Not stored if the file changed while it was read, or if the filesystem
+// has no room for attributes.
+void store_digest(int fd, const struct stat *st, HashAlgorithm algorithm,
+                  off_t length, const char *hex) {
+     struct stat after;
+     if (length != st->st_size || fstat(fd, &after) < 0 ||
+         after.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+         after.st_mtim.tv_nsec != st->st_mtim.tv_nsec ||
+         after.st_size != st->st_size) {
+          return;
+     }
+     char attribute[32];
+     snprintf(attribute, sizeof(attribute), "%s%s", DIGEST_XATTR_PREFIX,
+              hash_attributes[algorithm]);
+     char stored[64 + DIGEST_HEX_SIZE];
+     int len = digest_version(st, stored, sizeof(stored));
+     snprintf(stored + len, sizeof(stored) - (size_t)len, "%s", hex);
+     if (fsetxattr(fd, attribute, stored, strlen(stored), 0) < 0) {
+          log_debug("Digest of %s not stored: %m", hex);
+     }
+}
+
+// STOR drops the stored digests of the file it wrote, since writes within
+// one tick of the clock leave the modification time as it was
+void forget_digests(int fd) {
+     char attribute[32];
+     for (int i = 0; i < NUM_HASH_ALGORITHMS; i++) {
+          snprintf(attribute, sizeof(attribute), "%s%s", DIGEST_XATTR_PREFIX,
+                   hash_attributes[i]);
+          fremovexattr(fd, attribute);
+     }
+}
+
+// Takes as long for every input, so a guess cannot be timed
+bool same_digest(const unsigned char *a, const unsigned char *b, size_t len) {
+     unsigned char diff = 0;
+     for (size_t i = 0; i < len; i++) diff |= a[i] ^ b[i];
+     return diff == 0;
+}
+
+// One account of the user database
+typedef struct {
+     char *name;  // NULL in an empty slot
+     unsigned iterations;
+     unsigned char salt[USER_SALT_SIZE];
+     unsigned char hash[32];
+} UserRecord;
+
+// Open-addressing table of the accounts, linear probing, at most half full.
+// A reload builds a new one and swaps it in.
+typedef struct {
+     UserRecord *slots;
+     size_t capacity;  // a power of two
+     size_t count;
+     unsigned generation;
+} UserDb;
+
+// Verified logins, so clients reconnecting in a burst skip the slow hash.
+// Holds a quick salted digest of the password, never the password.
+typedef struct {
+     char name[AUTH_CACHE_NAME_SIZE];
+     unsigned char digest[32];
+     unsigned generation;  // of the user database it was checked against
+     uint64_t expires;     // monotonic ns
+} AuthCacheEntry;
+
+pthread_rwlock_t user_db_lock = PTHREAD_RWLOCK_INITIALIZER;
+UserDb *user_db = NULL;
+const char *users_file = USERS_FILE;
+pthread_mutex_t auth_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+AuthCacheEntry auth_cache[AUTH_CACHE_SLOTS];
+
+// Accounts of a server started without a user database
+const char *default_users[][2] = {{"user1", "password1"},
+                                  {"user2", "password2"}};
+
+unsigned user_hash(const char *name) {
+     uint32_t hash = 2166136261u;
+     for (; *name != '\0'; name++) {
+          hash = (hash ^ (unsigned char)*name) * 16777619u;
+     }
+     return hash;
+}
+
+UserRecord *find_user(UserDb *db, const char *name) {
+     size_t mask = db->capacity - 1;
+     for (size_t slot = user_hash(name) & mask; db->slots[slot].name != NULL;
+          slot = (slot + 1) & mask) {
+          if (strcmp(db->slots[slot].name, name) == 0) return &db->slots[slot];
+     }
+     return NULL;
+}
+
+void free_user_db(UserDb *db) {
+     if (db == NULL) return;
+     for (size_t i = 0; i < db->capacity; i++) free(db->slots[i].name);
+     free(db->slots);
+     free(db);
+}
+
+// Doubles the table when it gets more than half full
+bool add_user(UserDb *db, const UserRecord *record) {
+     if ((db->count + 1) * 2 > db->capacity) {
+          UserDb grown = {calloc(db->capacity * 2, sizeof(UserRecord)),
+                          db->capacity * 2, 0, db->generation};
+          if (grown.slots == NULL) return false;
+          for (size_t i = 0; i < db->capacity; i++) {
+               if (db->slots[i].name != NULL) add_user(&grown, &db->slots[i]);
+          }
+          free(db->slots);
+          *db = grown;
+     }
+     size_t mask = db->capacity - 1;
+     size_t slot = user_hash(record->name) & mask;
+     while (db->slots[slot].name != NULL) slot = (slot + 1) & mask;
+     db->slots[slot] = *record;
+     db->count++;
+     return true;
+}
+
+bool parse_hex(const char *text, size_t len, unsigned char *out) {
+     if (strlen(text) != len * 2) return false;
+     for (size_t i = 0; i < len; i++) {
+          unsigned byte;
+          if (!isxdigit((unsigned char)text[i * 2]) ||
+              !isxdigit((unsigned char)text[i * 2 + 1]) ||
+              sscanf(text + i * 2, "%2x", &byte) != 1) {
+               return false;
+          }
+          out[i] = (unsigned char)byte;
+     }
+     return true;
+}
+
+// A line of the user database: name:pbkdf2-sha256$iterations$salt$hash,
+// salt and hash in hex
+bool parse_user_line(char *line, UserRecord *record) {
+     char *colon = strchr(line, ':');
+     if (colon == NULL || colon == line) return false;
+     *colon = '\0';
+     char *fields[4];
+     char *save_ptr;
+     int count = 0;
+     for (char *field = strtok_r(colon + 1, "$", &save_ptr);
+          field != NULL && count < 4; field = strtok_r(NULL, "$", &save_ptr)) {
+          fields[count++] = field;
+     }
+     long long iterations = count == 4 ? parse_size(fields[1]) : -1;
+     if (count != 4 || strcmp(fields[0], "pbkdf2-sha256") != 0 ||
+         iterations < 1 || iterations > UINT_MAX ||
+         !parse_hex(fields[2], USER_SALT_SIZE, record->salt) ||
+         !parse_hex(fields[3], sizeof(record->hash), record->hash)) {
+          return false;
+     }
+     record->iterations = (unsigned)iterations;
+     record->name = strdup(line);
+     return record->name != NULL;
+}
+
+UserDb *new_user_db() {
+     UserDb *db = calloc(1, sizeof(UserDb));
+     if (db == NULL) return NULL;
+     db->capacity = 64;
+     db->slots = calloc(db->capacity, sizeof(UserRecord));
+     if (db->slots == NULL) {
+          free(db);
+          return NULL;
+     }
+     return db;
+}
+
+// Hashes password under a fresh random salt; false if the kernel has no
+// randomness to give
+bool hash_password(const char *password, UserRecord *record) {
+     if (getrandom(record->salt, sizeof(record->salt), 0) !=
+         (ssize_t)sizeof(record->salt)) {
+          return false;
+     }
+     record->iterations = USER_HASH_ITERATIONS;
+     pbkdf2_sha256(password, record->salt, sizeof(record->salt),
+                   record->iterations, record->hash);
+     return true;
+}
+
+// Reads the user database. Without the file the server keeps the default
+// accounts; NULL if the file is there but cannot be read.
+UserDb *read_user_db(const char *path) {
+     FILE *file = fopen(path, "re");
+     if (file == NULL && errno != ENOENT) {
+          log_error("Cannot read the user database %s: %m", path);
+          return NULL;
+     }
+     UserDb *db = new_user_db();
+     if (db == NULL) {
+          if (file != NULL) fclose(file);
+          return NULL;
+     }
+
+     if (file == NULL) {
+          log_warn("No user database at %s, only the default accounts can "
+                   "log in",
+                   path);
+          size_t count = sizeof(default_users) / sizeof(default_users[0]);
+          for (size_t i = 0; i < count; i++) {
+               UserRecord record = {strdup(default_users[i][0]), 0, {0}, {0}};
+               if (!hash_password(default_users[i][1], &record)) {
+                    log_error("Cannot salt the password of %s: %m",
+                              default_users[i][0]);
+                    free(record.name);
+                    continue;
+               }
+               if (record.name == NULL || !add_user(db, &record)) {
+                    free(record.name);
+               }
+          }
+          return db;
+     }
+
+     char line[BUFFER_SIZE];
+     int line_number = 0;
+     while (fgets(line, sizeof(line), file) != NULL) {
+          line_number++;
+          line[strcspn(line, "\r\n")] = '\0';
+          if (line[0] == '\0' || line[0] == '#') continue;
+          UserRecord record;
+          if (!parse_user_line(line, &record)) {
+               log_warn("%s:%d: not a valid account, skipped", path,
+                        line_number);
+               continue;
+          }
+          if (find_user(db, record.name) != NULL || !add_user(db, &record)) {
+               log_warn("%s:%d: %s skipped", path, line_number, record.name);
+               free(record.name);
+          }
+     }
+     fclose(file);
+     return db;
+}
+
+// Swaps in a freshly read user database. Sessions stay logged in; the auth
+// cache is emptied by the new generation.
+void load_user_db() {
+     UserDb *db = read_user_db(users_file);
+     if (db == NULL) {
+          log_error("Keeping the user database loaded before");
+          return;
+     }
+     pthread_rwlock_wrlock(&user_db_lock);
+     UserDb *old = user_db;
+     db->generation = old != NULL ? old->generation + 1 : 1;
+     user_db = db;
+     pthread_rwlock_unlock(&user_db_lock);
+     free_user_db(old);
+     log_info("Loaded %zu accounts", db->count);
+}
+
+// --hash-password: prints the user database line of name for the password
+// read from standard input
+bool print_user_line(const char *name) {
+     char password[BUFFER_SIZE];
+     if (strchr(name, ':') != NULL || strchr(name, ' ') != NULL ||
+         fgets(password, sizeof(password), stdin) == NULL) {
+          fprintf(stderr, "Give a user name without ':' or spaces and the "
+                          "password on standard input\n");
+          return false;
+     }
+     password[strcspn(password, "\r\n")] = '\0';
+
+     UserRecord record;
+     if (!hash_password(password, &record)) {
+          fprintf(stderr, "Cannot get random bytes for the salt: %s\n",
+                  strerror(errno));
+          return false;
+     }
+     printf("%s:pbkdf2-sha256$%u$", name, record.iterations);
+     for (size_t i = 0; i < sizeof(record.salt); i++) {
+          printf("%02x", record.salt[i]);
+     }
+     putchar('$');
+     for (size_t i = 0; i < sizeof(record.hash); i++) {
+          printf("%02x", record.hash[i]);
+     }
+     putchar('\n');
+     return true;
+}
+
+bool validate_credentials(const char *username, const char *password) {
+     // Unknown users cost the same hash as known ones
+     UserRecord record = {NULL, USER_HASH_ITERATIONS, {0}, {0}};
+     bool known = false;
+     unsigned generation = 0;
+     pthread_rwlock_rdlock(&user_db_lock);
+     UserRecord *found = user_db != NULL ? find_user(user_db, username) : NULL;
+     if (found != NULL) {
+          record = *found;
+          known = true;
+          generation = user_db->generation;
+     }
+     pthread_rwlock_unlock(&user_db_lock);
+
+     // One round of SHA-256 over the salt and password finds a recent
+     // login of the same user with the same password
+     unsigned char digest[32];
+     Sha256 sha;
+     sha256_init(&sha);
+     sha256_update(&sha, record.salt, sizeof(record.salt));
+     sha256_update(&sha, password, strlen(password));
+     sha256_final(&sha, digest);
+     AuthCacheEntry *cached =
+         &auth_cache[user_hash(username) % AUTH_CACHE_SLOTS];
+     uint64_t now = monotonic_ns();
+     if (known) {
+          pthread_mutex_lock(&auth_cache_lock);
+          bool hit = cached->generation == generation &&
+                     cached->expires > now &&
+                     strcmp(cached->name, username) == 0 &&
+                     same_digest(cached->digest, digest, sizeof(digest));
+          pthread_mutex_unlock(&auth_cache_lock);
+          if (hit) {
+               metrics_add(auth_cache_hits, 1);
+               return true;
+          }
+     }
+
+     unsigned char hash[32];
+     pbkdf2_sha256(password, record.salt, sizeof(record.salt),
+                   record.iterations, hash);
+     if (!known || !same_digest(hash, record.hash, sizeof(hash))) return false;
+
+     // Names too long for the cache are always checked in full
+     if (strlen(username) < sizeof(cached->name)) {
+          pthread_mutex_lock(&auth_cache_lock);
+          snprintf(cached->name, sizeof(cached->name), "%s", username);
+          memcpy(cached->digest, digest, sizeof(digest));
+          cached->generation = generation;
+          cached->expires = now + AUTH_CACHE_TTL_S * 1000000000ull;
+          pthread_mutex_unlock(&auth_cache_lock);
+     }
+     return true;
+}
+
+// openat with the path resolved beneath dir_fd: absolute paths, ".." and
+// symbolic links cannot lead out of it. Kernels without openat2 get the
+// same rule checked on the path itself, apart from symbolic links.
+int open_beneath(int dir_fd, const char *path, int flags, mode_t mode) {
+     struct open_how how = {0};
+     how.flags = (uint64_t)flags;
+     how.mode = flags & O_CREAT ? mode : 0;
+     how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+     int fd = (int)syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+     if (fd >= 0 || errno != ENOSYS) return fd;
+
+     char copy[BUFFER_SIZE];
+     snprintf(copy, sizeof(copy), "%s", path);
+     char *save_ptr;
+     for (char *token = strtok_r(copy, "/", &save_ptr); token != NULL;
+          token = strtok_r(NULL, "/", &save_ptr)) {
+          if (strcmp(token, "..") == 0) {
+               errno = EXDEV;
+               return -1;
+          }
+     }
+     if (path[0] == '/') {
+          errno = EXDEV;
+          return -1;
+     }
+     return openat(dir_fd, path, flags, mode);
+}
+
+// For commands that create or remove an entry: opens the directory that
+// holds the last component of path beneath dir_fd, and copies that
+// component into name
+int open_parent_beneath(int dir_fd, const char *path, char *name,
+                        size_t name_size) {
+     char parent[BUFFER_SIZE];
+     snprintf(parent, sizeof(parent), "%s", path);
+     size_t len = strlen(parent);
+     while (len > 1 && parent[len - 1] == '/') parent[--len] = '\0';
+
+     char *slash = strrchr(parent, '/');
+     const char *last = slash != NULL ? slash + 1 : parent;
+     if (*last == '\0' || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+          errno = EINVAL;
+          return -1;
+     }
+     snprintf(name, name_size, "%s", last);
+
+     if (slash == NULL) {
+          snprintf(parent, sizeof(parent), ".");
+     } else if (slash == parent) {
+          slash[1] = '\0';
+     } else {
+          *slash = '\0';
+     }
+     return open_beneath(dir_fd, parent, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+}
+
+bool set_path(Session *session, const char *new_dir) {
+     if (new_dir == NULL || strcmp(new_dir, "") == 0) {
+          return false;
+     }
+
+     char temp_path[BUFFER_SIZE];
+     snprintf(temp_path, sizeof(temp_path), "%s", session->current_dir);
+
+     char dir_copy[BUFFER_SIZE];
+     snprintf(dir_copy, sizeof(dir_copy), "%s", new_dir);
+
+     char *save_ptr;
+     char *token = strtok_r(dir_copy, "/", &save_ptr);
+     while (token != NULL) {
+          if (strcmp(token, ".") == 0) {
+               // Stays where it is
+          } else if (strcmp(token, "..") == 0) {
+               // Handle "..", go up one directory if possible
+               // Avoid going above /server_data
+               if (strcmp(temp_path, ROOT_DIR) == 0) {
+                    // Already at /server_data, can't go further up
+                    return false;
+               }
+
+               // Try to move one directory up
+               char *last_slash = strrchr(temp_path, '/');
+               if (last_slash != NULL) {
+                    *last_slash = '\0';  // Remove the last directory
+               }
+          } else {
+               // Otherwise, it's a subdirectory, so append it
+               if (strlen(temp_path) + strlen(token) + 2 < sizeof(temp_path)) {
+                    strcat(temp_path, "/");
+                    strcat(temp_path, token);
+               } else {
+                    return false;  // Path too long
+               }
+          }
+          token = strtok_r(NULL, "/", &save_ptr);
+     }
+
+     // The first component below /server_data is the area: public, or the
+     // user's own directory once logged in
+     if (strncmp(temp_path, ROOT_DIR "/", strlen(ROOT_DIR "/")) != 0) {
+          return false;
+     }
+     char area[BUFFER_SIZE];
+     snprintf(area, sizeof(area), "%s", temp_path + strlen(ROOT_DIR "/"));
+     char *rest = strchr(area, '/');
+     if (rest != NULL) *rest++ = '\0';
+
+     if (strcmp(area, "public") != 0 &&
+         !(session->client_session.authenticated &&
+           strcmp(area, session->client_session.username) == 0)) {
+          return false;
+     }
+
+     // The rest is resolved beneath the area, so neither ".." nor a
+     // symbolic link can lead into another one
+     int area_fd = open_beneath(root_fd, area,
+                                O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+     int dir_fd = area_fd;
+     if (area_fd >= 0 && rest != NULL) {
+          dir_fd = open_beneath(area_fd, rest, O_PATH | O_DIRECTORY | O_CLOEXEC,
+                                0);
+          close(area_fd);
+     }
+     if (dir_fd < 0) {
+          log_debug("Cannot enter %s: %m", temp_path);
+          return false;  // The path is invalid or outside of /server_data
+     }
+
+     close(session->dir_fd);
+     session->dir_fd = dir_fd;
+     descriptor_path(dir_fd, session->dir_path, sizeof(session->dir_path));
+     snprintf(session->current_dir, sizeof(session->current_dir), "%s",
+              temp_path);
+     return true;
+}
+
+// A verb packed into one word, first letter in the high byte and three
+// letter verbs padded with a zero byte
+#define VERB(a, b, c, d)                                      \
+     ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | \
+      (uint32_t)(d))
+
+// Upper-cases and packs a verb of three or four letters, 0 for anything else
+uint32_t pack_verb(const char *verb) {
+     uint32_t packed = 0;
+     int len = 0;
+     for (; len < 4 && verb[len] != '\0'; len++) {
+          packed = packed << 8 | (uint8_t)toupper((unsigned char)verb[len]);
+     }
+     if (len < 3 || verb[len] != '\0') return 0;
+     return len == 3 ? packed << 8 : packed;
+}
+
+// Index of the verb in the dispatch table, -1 if it is not a command. The
+// compiler turns the switch into a jump table or a binary search.
+int find_command(uint32_t verb) {
+     switch (verb) {
+          case VERB('U', 'S', 'E', 'R'): return CMD_USER;
+          case VERB('P', 'A', 'S', 'S'): return CMD_PASS;
+          case VERB('A', 'C', 'C', 'T'): return CMD_ACCT;
+          case VERB('C', 'W', 'D', 0): return CMD_CWD;
+          case VERB('C', 'D', 'U', 'P'): return CMD_CDUP;
+          case VERB('S', 'M', 'N', 'T'): return CMD_SMNT;
+          case VERB('Q', 'U', 'I', 'T'): return CMD_QUIT;
+          case VERB('R', 'E', 'I', 'N'): return CMD_REIN;
+          case VERB('P', 'O', 'R', 'T'): return CMD_PORT;
+          case VERB('P', 'A', 'S', 'V'): return CMD_PASV;
+          case VERB('T', 'Y', 'P', 'E'): return CMD_TYPE;
+          case VERB('S', 'T', 'R', 'U'): return CMD_STRU;
+          case VERB('M', 'O', 'D', 'E'): return CMD_MODE;
+          case VERB('R', 'E', 'T', 'R'): return CMD_RETR;
+          case VERB('S', 'T', 'O', 'R'): return CMD_STOR;
+          case VERB('D', 'E', 'L', 'E'): return CMD_DELE;
+          case VERB('R', 'N', 'F', 'R'): return CMD_RNFR;
+          case VERB('R', 'N', 'T', 'O'): return CMD_RNTO;
+          case VERB('A', 'B', 'O', 'R'): return CMD_ABOR;
+          case VERB('L', 'I', 'S', 'T'): return CMD_LIST;
+          case VERB('N', 'L', 'S', 'T'): return CMD_NLST;
+          case VERB('S', 'I', 'T', 'E'): return CMD_SITE;
+          case VERB('S', 'Y', 'S', 'T'): return CMD_SYST;
+          case VERB('S', 'T', 'A', 'T'): return CMD_STAT;
+          case VERB('H', 'E', 'L', 'P'): return CMD_HELP;
+          case VERB('N', 'O', 'O', 'P'): return CMD_NOOP;
+          case VERB('P', 'W', 'D', 0): return CMD_PWD;
+          case VERB('M', 'K', 'D', 0): return CMD_MKD;
+          case VERB('R', 'M', 'D', 0): return CMD_RMD;
+          case VERB('A', 'L', 'L', 'O'): return CMD_ALLO;
+          case VERB('R', 'E', 'S', 'T'): return CMD_REST;
+          case VERB('S', 'I', 'Z', 'E'): return CMD_SIZE;
+          case VERB('M', 'D', 'T', 'M'): return CMD_MDTM;
+          case VERB('M', 'F', 'M', 'T'): return CMD_MFMT;
+          case VERB('R', 'A', 'N', 'G'): return CMD_RANG;
+          case VERB('M', 'L', 'S', 'D'): return CMD_MLSD;
+          case VERB('M', 'L', 'S', 'T'): return CMD_MLST;
+          case VERB('O', 'P', 'T', 'S'): return CMD_OPTS;
+          case VERB('H', 'A', 'S', 'H'): return CMD_HASH;
+          case VERB('X', 'C', 'R', 'C'): return CMD_XCRC;
+          default: return -1;
+     }
+}
+
+int set_nonblocking(int fd) {
+     int flags = fcntl(fd, F_GETFL, 0);
+     if (flags < 0) return -1;
+     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Records the events a session descriptor waits for; they take effect when
+// the worker re-arms the session (events == 0 removes the descriptor)
+void set_interest(EventSource *source, uint32_t events) {
+     source->events = events;
+}
+
+void arm_source(EventSource *source) {
+     if (source->fd < 0) return;
+
+     if (source->events == 0) {
+          if (source->registered) {
+               epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+               source->registered = false;
+          }
+          return;
+     }
+
+     struct epoll_event event = {0};
+     event.events = source->events | EPOLLONESHOT;
+     event.data.ptr = source;
+
+     int op = source->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+     if (epoll_ctl(epoll_fd, op, source->fd, &event) < 0) {
+          log_error("epoll_ctl failed: %m");
+          return;
+     }
+     source->registered = true;
+}
+
+void update_control_interest(Session *session) {
+     uint32_t events = 0;
+     if (session->input_len < sizeof(session->input) - 1) events |= EPOLLIN;
+     if (session->output_sent < session->output_len) events |= EPOLLOUT;
+     set_interest(&session->control, events);
+}
+
+void queue_reply(Session *session, const char *reply) {
+     size_t len = strlen(reply);
+
+     if (session->output_len + len > sizeof(session->output)) {
+          // Compact whatever has already been sent
+          memmove(session->output, session->output + session->output_sent,
+                  session->output_len - session->output_sent);
+          session->output_len -= session->output_sent;
+          session->output_sent = 0;
+     }
+     if (session->output_len + len > sizeof(session->output)) {
+          log_warn("Reply buffer full, dropping reply");
+          return;
+     }
+
+     memcpy(session->output + session->output_len, reply, len);
+     session->output_len += len;
+}
+
+// Closing a descriptor also drops it from the epoll set
+void close_source(EventSource *source) {
+     if (source->fd < 0) return;
+     close(source->fd);
+     source->fd = -1;
+     source->events = 0;
+     source->registered = false;
+}
+
+void close_data_socket(Session *session) { close_source(&session->data); }
+
+// Gives the leased passive port back, along with a data connection that was
+// handed over but never used
+void release_pasv_port(Session *session) {
+     PasvPort *port = session->pasv_port;
+     if (port == NULL) return;
+
+     pthread_mutex_lock(&pasv_lock);
+     Session **link = &port->lessees;
+     while (*link != session) link = &(*link)->next_lessee;
+     *link = session->next_lessee;
+     pthread_mutex_unlock(&pasv_lock);
+
+     session->pasv_port = NULL;
+     int data_sock = atomic_exchange(&session->pasv_accepted, -1);
+     if (data_sock >= 0) close(data_sock);
+     metrics_add(pasv_leases, -1);
+}
+
+// Leases the next port of the range that no session of the same client host
+// holds, so a PASV needs no system call. Returns NULL if the host holds all.
+PasvPort *lease_pasv_port(Session *session) {
+     PasvPort *leased = NULL;
+     pthread_mutex_lock(&pasv_lock);
+     for (int i = 0; i < pasv_port_count && leased == NULL; i++) {
+          PasvPort *port = &pasv_ports[(pasv_next_port + i) % pasv_port_count];
+          Session *lessee = port->lessees;
+          while (lessee != NULL &&
+                 lessee->peer_addr.s_addr != session->peer_addr.s_addr) {
+               lessee = lessee->next_lessee;
+          }
+          if (lessee == NULL) leased = port;
+     }
+     if (leased != NULL) {
+          pasv_next_port = (int)(leased - pasv_ports + 1) % pasv_port_count;
+          session->next_lessee = leased->lessees;
+          leased->lessees = session;
+     }
+     pthread_mutex_unlock(&pasv_lock);
+
+     session->pasv_port = leased;
+     if (leased != NULL) metrics_add(pasv_leases, 1);
+     return leased;
+}
+
+void close_transfer_file(Session *session) {
+     if (session->file_fd >= 0) {
+          close(session->file_fd);
+          session->file_fd = -1;
+     }
+     release_blob(session->cached_listing);
+     session->cached_listing = NULL;
+     release_blob(session->cached_file);
+     session->cached_file = NULL;
+     session->cached_pos = 0;
+     free(session->new_listing);
+     session->new_listing = NULL;
+     session->listing_start = 0;
+     if (session->tar != NULL) {
+          for (int i = 0; i < session->tar->depth; i++) {
+               close(session->tar->dir_fds[i]);
+          }
+          free(session->tar);
+          session->tar = NULL;
+     }
+     free(session->digest_job);
+     session->digest_job = NULL;
+}
+
+bool is_listing_command(int command_id) {
+     return command_id == CMD_LIST || command_id == CMD_NLST ||
+            command_id == CMD_MLSD;
+}
+
+const char *entry_type(const struct stat *st) {
+     if (S_ISDIR(st->st_mode)) return "dir";
+     if (S_ISREG(st->st_mode)) return "file";
+     if (S_ISLNK(st->st_mode)) return "OS.unix=symlink";
+     return "OS.unix=special";
+}
+
+// One MLSD/MLST line: "type=file;size=12;modify=20240101120000;perm=r; name"
+int format_facts(const char *name, const char *type, const struct stat *st,
+                 char *out, size_t size) {
+     struct tm tm;
+     char modify[32];
+     gmtime_r(&st->st_mtime, &tm);
+     strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+
+     bool writable = st->st_mode & S_IWUSR;
+     const char *perm;
+     if (S_ISDIR(st->st_mode)) {
+          perm = writable ? "cdeflmp" : "el";
+     } else {
+          perm = writable ? "adfrw" : "r";
+     }
+     return snprintf(out, size, "type=%s;size=%lld;modify=%s;perm=%s; %s\r\n",
+                     type, (long long)st->st_size, modify, perm, name);
+}
+
+// One LIST line in the layout of ls -l
+int format_list_line(const char *name, const struct stat *st, char *out,
+                     size_t size) {
+     const char *types = "?pc?d?b?-?l?s";
+     char mode[11];
+     mode[0] = S_ISREG(st->st_mode) ? '-' : types[(st->st_mode >> 12) & 0xF];
+     for (int i = 0; i < 9; i++) {
+          mode[i + 1] = st->st_mode & (0400 >> i) ? "rwx"[i % 3] : '-';
+     }
+     mode[10] = '\0';
+
+     struct tm tm;
+     char date[32];
+     localtime_r(&st->st_mtime, &tm);
+     strftime(date, sizeof(date), "%b %e %H:%M", &tm);
+
+     return snprintf(out, size, "%s %3lu %-8u %-8u %12lld %s %s\r\n", mode,
+                     (unsigned long)st->st_nlink, st->st_uid, st->st_gid,
+                     (long long)st->st_size, date, name);
+}
+
+// Formats the next entries of the listed directory into the transfer
+// buffer, reading them with getdents64 a batch at a time. Returns the bytes
+// formatted, 0 at the end of the directory, or -1 with errno set.
+ssize_t read_listing(Session *session) {
+     session->transfer_len = 0;
+     session->transfer_sent = 0;
+
+     while (1) {
+          if (session->dirents_pos == session->dirents_len) {
+               long len = syscall(SYS_getdents64, session->file_fd,
+                                  session->dirents, sizeof(session->dirents));
+               if (len <= 0) {
+                    return len < 0 ? -1 : (ssize_t)session->transfer_len;
+               }
+               session->dirents_len = (size_t)len;
+               session->dirents_pos = 0;
+          }
+
+          struct dirent64 *entry =
+              (struct dirent64 *)(session->dirents + session->dirents_pos);
+          const char *name = entry->d_name;
+          if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+               session->dirents_pos += entry->d_reclen;
+               continue;
+          }
+
+          char *out = session->transfer_buffer + session->transfer_len;
+          size_t room =
+              sizeof(session->transfer_buffer) - session->transfer_len;
+          int len = 0;
+          struct stat st;
+          if (session->transfer_command == CMD_NLST) {  // names only
+               len = snprintf(out, room, "%s\r\n", name);
+          } else if (fstatat(session->file_fd, name, &st,
+                             AT_SYMLINK_NOFOLLOW) < 0) {
+               // Removed since it was read, leave it out
+          } else if (session->transfer_command == CMD_LIST) {
+               len = format_list_line(name, &st, out, room);
+          } else {  // MLSD
+               len = format_facts(name, entry_type(&st), &st, out, room);
+          }
+
+          // The entry goes into the next batch once this one is sent
+          if ((size_t)len >= room) return (ssize_t)session->transfer_len;
+          session->transfer_len += (size_t)len;
+          session->dirents_pos += entry->d_reclen;
+     }
+}
+
+// Makes room for len bytes; frees the blob and returns NULL if it cannot
+CacheBlob *grow_blob(CacheBlob *blob, size_t len) {
+     if (blob != NULL && len <= blob->capacity) return blob;
+
+     size_t capacity = blob != NULL ? blob->capacity : TRANSFER_BUFFER_SIZE;
+     while (capacity < len) capacity *= 2;
+     CacheBlob *grown = realloc(blob, sizeof(CacheBlob) + capacity);
+     if (grown == NULL) {
+          free(blob);
+          return NULL;
+     }
+     if (blob == NULL) {
+          atomic_init(&grown->refs, 1);
+          grown->len = 0;
+     }
+     grown->capacity = capacity;
+     return grown;
+}
+
+// Same contract as read_listing. Sends the cached listing if there is
+// one; otherwise reads the directory and keeps a copy for the cache.
+ssize_t fill_listing(Session *session) {
+     CacheBlob *blob = session->cached_listing;
+     if (blob != NULL) {
+          size_t len = blob->len - session->cached_pos;
+          if (len > sizeof(session->transfer_buffer)) {
+               len = sizeof(session->transfer_buffer);
+          }
+          memcpy(session->transfer_buffer, blob->data + session->cached_pos,
+                 len);
+          session->cached_pos += len;
+          session->transfer_len = len;
+          session->transfer_sent = 0;
+          return (ssize_t)len;
+     }
+
+     ssize_t filled = read_listing(session);
+     if (filled < 0 || session->listing_start == 0) return filled;
+
+     blob = session->new_listing;
+     session->new_listing = NULL;
+     if (filled == 0) {
+          // Complete, the cache takes over the copy
+          blob = grow_blob(blob, 0);
+          if (blob != NULL) {
+               cache_store_listing(session->dir_path,
+                                   session->transfer_command,
+                                   session->listing_start, blob);
+          }
+          session->listing_start = 0;
+          return 0;
+     }
+
+     size_t len = (blob != NULL ? blob->len : 0) + (size_t)filled;
+     if (len > CACHE_MAX_LISTING) {
+          free(blob);
+          blob = NULL;
+     } else {
+          blob = grow_blob(blob, len);
+     }
+     if (blob == NULL) {
+          // Too large to cache, the rest is only streamed
+          session->listing_start = 0;
+          return filled;
+     }
+     memcpy(blob->data + blob->len, session->transfer_buffer, (size_t)filled);
+     blob->len = len;
+     session->new_listing = blob;
+     return filled;
+}
+
+// Gives a transfer waiting for its data connection DATA_WAIT_TIMEOUT_S
+void start_data_deadline(Session *session) {
+     EventSource *timer = &session->data_timer;
+     if (timer->fd < 0) {
+          timer->fd =
+              timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+     }
+     struct itimerspec deadline = {.it_value = {DATA_WAIT_TIMEOUT_S, 0}};
+     if (timer->fd < 0 || timerfd_settime(timer->fd, 0, &deadline, NULL) < 0) {
+          log_warn("No deadline for the data connection: %m");
+          return;
+     }
+     set_interest(timer, EPOLLIN);
+}
+
+void stop_data_deadline(Session *session) {
+     if (session->data_timer.events == 0) return;
+     struct itimerspec stop = {0};
+     timerfd_settime(session->data_timer.fd, 0, &stop, NULL);
+     set_interest(&session->data_timer, 0);
+}
+
+// Called once the data connection of a transfer is established
+void start_transfer(Session *session) {
+     stop_data_deadline(session);
+     set_nonblocking(session->data.fd);
+     session->transfer_len = 0;
+     session->transfer_sent = 0;
+     session->bytes_transferred = 0;
+     session->transfer_started = monotonic_ns();
+     session->block_header_len = BLOCK_HEADER_SIZE;  // no header pending
+     session->block_left = 0;
+     session->block_eof = false;
+     // Files that cannot be spliced stay on the buffered path, listings are
+     // formatted in user space. Block mode uploads must stop reading at
+     // every block header, which the batched splices cannot.
+     session->use_uring = io_backend == IO_BACKEND_URING &&
+                          ((session->transfer_command == CMD_STOR &&
+                            !session->block_mode) ||
+                           (session->transfer_command == CMD_RETR &&
+                            session->send_method < SEND_BUFFERED));
+
+     if (is_listing_command(session->transfer_command)) {
+          session->dirents_len = 0;
+          session->dirents_pos = 0;
+          queue_reply(session, "150 Here comes the directory listing.\r\n");
+          session->state = SESSION_SENDING;
+          set_interest(&session->data, EPOLLOUT);
+     } else if (session->transfer_command == CMD_SITE) {
+          queue_reply(session, "150 Opening data connection for the tar "
+                               "archive.\r\n");
+          session->state = SESSION_SENDING;
+          set_interest(&session->data, EPOLLOUT);
+     } else if (session->transfer_command == CMD_RETR) {
+          // Inform client that the transfer is starting
+          queue_reply(session,
+                      "150 Opening data connection for file transfer.\r\n");
+          session->state = SESSION_SENDING;
+          set_interest(&session->data, EPOLLOUT);
+     } else {  // STOR
+          // Open the file in the specified directory; a restarted upload,
+          // or one range of an upload split over several sessions, keeps
+          // what is already there
+          int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+          if (session->file_offset == 0 && session->file_end < 0) {
+               flags |= O_TRUNC;
+          }
+          session->file_fd =
+              open_beneath(session->dir_fd, session->file_path, flags, 0644);
+          if (session->file_fd < 0) {
+               // Nothing was sent on it yet, a block mode connection stays
+               if (!session->block_mode) close_data_socket(session);
+               queue_reply(session, "550 Failed to open file.\r\n");
+               session->state = SESSION_READING;
+               session->allocate_size = 0;
+               return;
+          }
+
+          // Reserve the announced size up front so the file is laid out in
+          // one go; the file size still only grows as data arrives. A file
+          // left longer than announced by an earlier upload is cut down,
+          // which is safe for every session of a split upload to do.
+          struct stat st;
+          if (session->allocate_size > 0) {
+               if (fallocate(session->file_fd, FALLOC_FL_KEEP_SIZE, 0,
+                             session->allocate_size) < 0) {
+                    log_warn("fallocate failed: %m");
+               }
+               if (fstat(session->file_fd, &st) == 0 &&
+                   st.st_size > session->allocate_size) {
+                    ftruncate(session->file_fd, session->allocate_size);
+               }
+          }
+          session->allocate_size = 0;
+          // The file now exists, and may have been truncated
+          invalidate_session_path(session, session->file_path);
+          file_cache_forget(session->file_fd);
+          session->writeback_offset = session->file_offset;
+          session->receive_method = RECEIVE_SPLICE;
+          session->state = SESSION_RECEIVING;
+          set_interest(&session->data, EPOLLIN);
+     }
+}
+
+// Opens the data connection for a transfer. In passive mode the client may
+// already have connected; otherwise the transfer waits for the event loop
+// to hand the connection over.
+void begin_data_transfer(Session *session, int command_id, char *response) {
+     session->transfer_command = command_id;
+
+     if (session->data.fd >= 0) {
+          // Kept open by the last transfer in block mode
+          start_transfer(session);
+     } else if (session->data_connection.active) {
+          int data_sock = socket(AF_INET, SOCK_STREAM, 0);
+          if (connect(data_sock,
+                      (struct sockaddr *)&session->data_connection.client_addr,
+                      sizeof(session->data_connection.client_addr)) < 0) {
+               log_warn("Failed to connect to client in active mode: %m");
+               snprintf(response, BUFFER_SIZE,
+                        "425 Can't open data connection.\r\n");
+               close(data_sock);
+               close_transfer_file(session);
+               return;
+          }
+          session->data.fd = data_sock;
+          start_transfer(session);
+     } else if (session->pasv_port == NULL) {
+          snprintf(response, BUFFER_SIZE, "425 Use PASV first.\r\n");
+          close_transfer_file(session);
+     } else {
+          int data_sock = atomic_exchange(&session->pasv_accepted, -1);
+          if (data_sock >= 0) {
+               session->data.fd = data_sock;
+               start_transfer(session);
+          } else {
+               session->state = SESSION_DATA_WAIT;
+               start_data_deadline(session);
+          }
+     }
+}
+
+
+typedef void (*CommandHandler)(Session *session, char *tokens[],
+                               int tokens_count, char *response);
+
+// An entry of the dispatch table. The handler runs once the command has at
+// least min_args arguments and, if needs_login is set, the user is logged in.
+typedef struct {
+     const char *name;
+     CommandHandler handler;
+     int min_args;
+     bool needs_login;
+} Command;
+
+extern const Command commands[NUM_COMMANDS];
+
+void cmd_user(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     strncpy(session->client_session.username, tokens[1],
+             sizeof(session->client_session.username) - 1);
+     snprintf(response, BUFFER_SIZE, "331 User name okay, need password.\r\n");
+}
+
+void cmd_pass(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     if (strlen(session->client_session.username) == 0) {
+          snprintf(response, BUFFER_SIZE, "503 Login with USER first.\r\n");
+     } else if (validate_credentials(session->client_session.username,
+                                     tokens[1])) {
+          metrics_add(logins_ok, 1);
+          session->client_session.authenticated = true;
+          snprintf(response, BUFFER_SIZE, "230 User logged in, proceed.\r\n");
+     } else {
+          metrics_add(logins_failed, 1);
+          snprintf(response, BUFFER_SIZE, "530 Not logged in.\r\n");
+     }
+}
+
+void cmd_cwd(Session *session, char *tokens[], int tokens_count,
+             char *response) {
+     (void)tokens_count;
+     if (set_path(session, tokens[1]))
+          snprintf(response, BUFFER_SIZE, "250 Ok\r\n");
+     else
+          snprintf(response, BUFFER_SIZE, "550 Error: Invalid path\r\n");
+}
+
+void cmd_quit(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens;
+     (void)tokens_count;
+     session->client_session.authenticated = false;
+     memset(session->client_session.username, 0,
+            sizeof(session->client_session.username));
+     snprintf(response, BUFFER_SIZE, "221 Goodbye.\r\n");
+     session->state = SESSION_CLOSING;
+}
+
+void cmd_pasv(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens;
+     (void)tokens_count;
+     // A new PASV replaces the port of the previous one, and the client
+     // connects to it even if a block mode connection is still open
+     release_pasv_port(session);
+     close_data_socket(session);
+
+     PasvPort *port = lease_pasv_port(session);
+     if (port == NULL) {
+          snprintf(response, BUFFER_SIZE,
+                   "425 No passive port left for your host.\r\n");
+          return;
+     }
+
+     // The address the client reached the server on, so clients on other
+     // hosts connect back to the right interface
+     uint32_t addr = ntohl(session->local_addr.s_addr);
+     snprintf(response, BUFFER_SIZE,
+              "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u).\r\n",
+              addr >> 24, (addr >> 16) & 0xFF, (addr >> 8) & 0xFF, addr & 0xFF,
+              (unsigned)port->port >> 8, (unsigned)port->port & 0xFF);
+     session->data_connection.active = 0;
+     log_debug("Server in passive mode on port %u", port->port);
+}
+
+void cmd_mode(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     char mode = (char)toupper((unsigned char)tokens[1][0]);
+     if (tokens[1][1] != '\0' || (mode != 'S' && mode != 'B')) {
+          snprintf(response, BUFFER_SIZE,
+                   "504 Only MODE S and MODE B are supported.\r\n");
+          return;
+     }
+     // A stream ends by closing the connection, so one kept open for block
+     // mode cannot carry it
+     if (mode == 'S' && session->block_mode) close_data_socket(session);
+     session->block_mode = mode == 'B';
+     snprintf(response, BUFFER_SIZE, "200 Mode set to %c.\r\n", mode);
+}
+
+void cmd_type(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)session;
+     (void)tokens;
+     (void)tokens_count;
+     snprintf(response, BUFFER_SIZE, "200 - Command ok \r\n");
+}
+
+void cmd_retr(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     // REST/RANG only apply to the transfer command right after
+     session->file_offset = session->restart_offset;
+     session->file_end = session->restart_end;
+     session->restart_offset = 0;
+     session->restart_end = -1;
+
+     snprintf(session->file_path, sizeof(session->file_path), "%s", tokens[1]);
+     log_debug("RETR %s", session->file_path);
+
+     // Check if the file exists and is accessible
+     struct stat st;
+     session->file_fd = open_beneath(session->dir_fd, tokens[1],
+                                     O_RDONLY | O_CLOEXEC, 0);
+     if (session->file_fd < 0 || fstat(session->file_fd, &st) < 0 ||
+         S_ISDIR(st.st_mode)) {
+          close_transfer_file(session);
+          snprintf(response, BUFFER_SIZE,
+                   "550 File not found or access denied.\r\n");
+     } else if (S_ISREG(st.st_mode) && session->file_offset > st.st_size) {
+          close_transfer_file(session);
+          snprintf(response, BUFFER_SIZE,
+                   "554 Restart offset beyond end of file.\r\n");
+     } else if (session->block_mode && !S_ISREG(st.st_mode)) {
+          // The last block is the one that reaches the end of the file,
+          // which must be known up front
+          close_transfer_file(session);
+          snprintf(response, BUFFER_SIZE,
+                   "550 Only regular files can be sent in block mode.\r\n");
+     } else {
+          if (session->block_mode &&
+              (session->file_end < 0 || session->file_end > st.st_size)) {
+               session->file_end = st.st_size;
+          }
+          // Small popular files are sent from memory, other regular files
+          // from the page cache
+          session->cached_file = file_cache_get(session->file_fd, &st);
+          if (session->cached_file != NULL) {
+               close(session->file_fd);
+               session->file_fd = -1;
+               session->send_method = SEND_CACHED;
+          } else {
+               session->send_method =
+                   S_ISREG(st.st_mode) ? SEND_SENDFILE : SEND_BUFFERED;
+          }
+          // The transfer continues from the event loop once the data
+          // connection is up
+          begin_data_transfer(session, CMD_RETR, response);
+     }
+}
+
+void cmd_stor(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     session->file_offset = session->restart_offset;
+     session->file_end = session->restart_end;
+     session->restart_offset = 0;
+     session->restart_end = -1;
+
+     snprintf(session->file_path, sizeof(session->file_path), "%s", tokens[1]);
+     log_debug("STOR %s", session->file_path);
+
+     // The file is opened once the data connection is up
+     begin_data_transfer(session, CMD_STOR, response);
+}
+
+// Starts LIST, NLST or MLSD of the current directory
+void begin_listing(Session *session, int command_id, char *response) {
+     // The listing goes over the data connection, so it is not limited by
+     // the size of a reply
+     session->cached_listing = cache_get_listing(
+         session->dir_path, command_id, &session->listing_start);
+     // A cached listing is sent from memory, otherwise the directory is read
+     if (session->cached_listing == NULL) {
+          session->file_fd = openat(session->dir_fd, ".",
+                                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     }
+     if (session->cached_listing == NULL && session->file_fd < 0) {
+          log_warn("LIST error: %m");
+          snprintf(response, BUFFER_SIZE, "550 Failed to open directory.\r\n");
+          return;
+     }
+     begin_data_transfer(session, command_id, response);
+}
+
+void cmd_list(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens;
+     (void)tokens_count;
+     begin_listing(session, CMD_LIST, response);
+}
+
+void cmd_nlst(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens;
+     (void)tokens_count;
+     begin_listing(session, CMD_NLST, response);
+}
+
+void cmd_mlsd(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens;
+     (void)tokens_count;
+     begin_listing(session, CMD_MLSD, response);
+}
+
+void cmd_help(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens;
+     (void)tokens_count;
+     (void)response;
+     // Longer than one response, goes straight to the reply buffer
+     queue_reply(
+         session,
+         //"214-The following commands are recognized: \nHELP  CWD  LIST  MKD  STOR\nPASS  PASV  PWD  QUIT  RETR\nRMD\n214 Help OK\r\n");
+         "COMMANDS\nHELP\nUsage: HELP\nDescription: Lists available commands.\nUSER\nUsage: USER <username>\nDescription: Sends the username.\nPASS\nUsage: PASS <password>\nDescription: Sends the password.\nPASV\nUsage: PASV\nDescription: Switches to passive mode for data transfer.\nPWD\nUsage: PWD\nDescription: Displays the current directory.\nCWD\nUsage: CWD <directory>\nDescription: Changes the current directory.\nMKD\nUsage: MKD <directory>\nDescription: Creates a new directory at the current location.\nLIST\nUsage: LIST\nDescription: Lists files and directories in the current directory over the data connection.\nNLST\nUsage: NLST\nDescription: Lists only the names in the current directory over the data connection.\nMLSD\nUsage: MLSD\nDescription: Lists the current directory with machine-readable facts (type, size, modify, perm) over the data connection.\nMLST\nUsage: MLST [name]\nDescription: Shows the facts of one file or of the current directory.\nRMD\nUsage: RMD <directory>\nDescription: Removes the specified directory (must be empty).\nMODE\nUsage: MODE <S|B>\nDescription: Stream mode closes the data connection after every transfer; block mode keeps it open and marks the end of every file.\nTYPE\nUsage: TYPE <type>\nWarning: Not fully implemented, only supports binary mode.\nDescription: Sets the file transfer type (e.g., ASCII or binary).\nRETR\nUsage: RETR <filename>\nDescription: Downloads the file from the server.\nSTOR\nUsage: STOR <filename>\nDescription: Uploads a file.\nALLO\nUsage: ALLO <size>\nDescription: Announces the size of the next upload so the server can reserve the space.\nREST\nUsage: REST <offset>\nDescription: Starts the next RETR or STOR at the given byte offset.\nSIZE\nUsage: SIZE <filename>\nDescription: Shows the size of a file in bytes.\nMDTM\nUsage: MDTM <filename>\nDescription: Shows the modification time of a file as YYYYMMDDHHMMSS in UTC.\nMFMT\nUsage: MFMT <YYYYMMDDHHMMSS> <filename>\nDescription: Sets the modification time of a file.\nRANG\nUsage: RANG <start> <end>\nDescription: Limits the next RETR or STOR to the bytes from start to end, inclusive.\nOPTS\nUsage: OPTS HASH [SHA-256|CRC32C|XXH64]\nDescription: Shows or picks the algorithm of HASH.\nHASH\nUsage: HASH <filename>\nDescription: Shows the digest of a file.\nXCRC\nUsage: XCRC <filename>\nDescription: Shows the CRC-32C of a file.\nQUIT\nUsage: QUIT\nDescription: Disconnects\r\n");
+}
+
+// ABOR: a transfer still waiting for its data connection, or a digest being
+// read, has been ended with 426 when the command arrived, see cancels_wait
+void cmd_abor(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)session;
+     (void)tokens;
+     (void)tokens_count;
+     snprintf(response, BUFFER_SIZE, "226 ABOR command successful.\r\n");
+}
+
+void cmd_noop(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)session;
+     (void)tokens;
+     (void)tokens_count;
+     snprintf(response, BUFFER_SIZE, "200 NOOP ok.\r\n");
+}
+
+void cmd_pwd(Session *session, char *tokens[], int tokens_count,
+             char *response) {
+     (void)tokens;
+     (void)tokens_count;
+     snprintf(response, BUFFER_SIZE, "257 \"%.1000s\"\r\n",
+              session->current_dir);
+}
+
+void cmd_mkd(Session *session, char *tokens[], int tokens_count,
+             char *response) {
+     (void)tokens_count;
+     char name[BUFFER_SIZE];
+     int parent_fd =
+         open_parent_beneath(session->dir_fd, tokens[1], name, sizeof(name));
+
+     if (parent_fd >= 0 && backend_mkdir(parent_fd, name, 0755) == 0) {
+          invalidate_session_path(session, tokens[1]);
+          snprintf(response, BUFFER_SIZE, "257 \"%s\" directory created.\r\n",
+                   tokens[1]);
+     } else {
+          log_debug("MKD error: %m");
+          snprintf(response, BUFFER_SIZE,
+                   "550 Failed to create directory.\r\n");
+     }
+     if (parent_fd >= 0) close(parent_fd);
+}
+
+void cmd_rmd(Session *session, char *tokens[], int tokens_count,
+             char *response) {
+     (void)tokens_count;
+     char name[BUFFER_SIZE];
+     int parent_fd =
+         open_parent_beneath(session->dir_fd, tokens[1], name, sizeof(name));
+
+     if (parent_fd >= 0 && backend_rmdir(parent_fd, name) == 0) {
+          invalidate_session_path(session, tokens[1]);
+          snprintf(response, BUFFER_SIZE, "250 \"%s\" directory removed.\r\n",
+                   tokens[1]);
+     } else {
+          log_debug("RMD error: %m");
+          snprintf(response, BUFFER_SIZE,
+                   "550 Failed to remove directory.\r\n");
+     }
+     if (parent_fd >= 0) close(parent_fd);
+}
+
+void cmd_allo(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     long long size = parse_size(tokens[1]);
+     if (size < 0) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 Syntax error in parameters or arguments.\r\n");
+          return;
+     }
+     session->allocate_size = (off_t)size;
+     snprintf(response, BUFFER_SIZE, "200 ALLO command successful.\r\n");
+}
+
+void cmd_rest(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     long long offset = parse_size(tokens[1]);
+     if (offset < 0) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 Syntax error in parameters or arguments.\r\n");
+          return;
+     }
+     session->restart_offset = (off_t)offset;
+     session->restart_end = -1;
+     snprintf(response, BUFFER_SIZE,
+              "350 Restarting at %lld. Send STOR or RETR to initiate "
+              "transfer.\r\n",
+              offset);
+}
+
+void cmd_size(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     struct stat st;
+     int fd = open_beneath(session->dir_fd, tokens[1], O_PATH | O_CLOEXEC, 0);
+     if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+          snprintf(response, BUFFER_SIZE, "213 %lld\r\n",
+                   (long long)st.st_size);
+     } else {
+          snprintf(response, BUFFER_SIZE, "550 Could not get file size.\r\n");
+     }
+     if (fd >= 0) close(fd);
+}
+
+void cmd_mdtm(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     struct stat st;
+     int fd = open_beneath(session->dir_fd, tokens[1], O_PATH | O_CLOEXEC, 0);
+     if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+          struct tm tm;
+          char modify[32];
+          gmtime_r(&st.st_mtime, &tm);
+          strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+          snprintf(response, BUFFER_SIZE, "213 %s\r\n", modify);
+     } else {
+          snprintf(response, BUFFER_SIZE,
+                   "550 Could not get modification time.\r\n");
+     }
+     if (fd >= 0) close(fd);
+}
+
+// Parses a YYYYMMDDHHMMSS[.fff] time in UTC, false if it is not one
+bool parse_modify_time(const char *text, struct timespec *time) {
+     struct tm tm = {0};
+     const char *end = strptime(text, "%Y%m%d%H%M%S", &tm);
+     if (end == NULL || end - text != 14) return false;
+     time->tv_sec = timegm(&tm);
+     time->tv_nsec = 0;
+     if (*end == '.') {
+          long scale = 100000000;
+          for (end++; isdigit((unsigned char)*end) && scale > 0; end++) {
+               time->tv_nsec += (*end - '0') * scale;
+               scale /= 10;
+          }
+     }
+     return *end == '\0';
+}
+
+// MFMT <time> <filename> sets the modification time of a file, so a mirror
+// can carry it over with the contents
+void cmd_mfmt(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     struct timespec times[2];
+     if (!parse_modify_time(tokens[1], &times[1])) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 Time must be YYYYMMDDHHMMSS in UTC.\r\n");
+          return;
+     }
+     times[0].tv_nsec = UTIME_OMIT;
+
+     struct stat st;
+     int fd = open_beneath(session->dir_fd, tokens[2], O_RDONLY | O_CLOEXEC, 0);
+     if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+         futimens(fd, times) == 0) {
+          // The parent's cached listing carries the old modify fact;
+          // digests key on mtime and size and go stale on their own
+          invalidate_session_path(session, tokens[2]);
+          snprintf(response, BUFFER_SIZE, "213 Modify=%s; %.1000s\r\n",
+                   tokens[1], tokens[2]);
+     } else {
+          log_debug("MFMT error: %m");
+          snprintf(response, BUFFER_SIZE,
+                   "550 Could not set modification time.\r\n");
+     }
+     if (fd >= 0) close(fd);
+}
+
+void cmd_rang(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     // RANG <start> <end>, both inclusive; "RANG 1 0" clears it
+     long long start = parse_size(tokens[1]);
+     long long end = parse_size(tokens[2]);
+     if (start < 0 || end < 0) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 Syntax error in parameters or arguments.\r\n");
+     } else if (start == 1 && end == 0) {
+          session->restart_offset = 0;
+          session->restart_end = -1;
+          snprintf(response, BUFFER_SIZE,
+                   "350 Restarting at 0. End marker reset.\r\n");
+     } else if (end < start) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 End of range before its start.\r\n");
+     } else if (end == LLONG_MAX) {
+          // The exclusive end would not fit
+          snprintf(response, BUFFER_SIZE, "501 End of range too large.\r\n");
+     } else {
+          session->restart_offset = (off_t)start;
+          session->restart_end = (off_t)end + 1;
+          snprintf(response, BUFFER_SIZE,
+                   "350 Restarting at %lld. Ending at %lld.\r\n", start, end);
+     }
+}
+
+void cmd_mlst(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     // Facts of one entry of the current directory, or of the directory
+     // itself
+     const char *name = tokens_count < 2 ? "." : tokens[1];
+     int fd = tokens_count < 2
+                  ? session->dir_fd
+                  : open_beneath(session->dir_fd, name,
+                                 O_PATH | O_NOFOLLOW | O_CLOEXEC, 0);
+     struct stat st;
+     char facts[BUFFER_SIZE / 2];
+     bool found = fd >= 0 && fstat(fd, &st) == 0;
+     if (fd >= 0 && fd != session->dir_fd) close(fd);
+     if (!found) {
+          snprintf(response, BUFFER_SIZE, "550 Could not get file status.\r\n");
+          return;
+     }
+     format_facts(tokens_count < 2 ? session->current_dir : name,
+                  tokens_count < 2 ? "cdir" : entry_type(&st), &st, facts,
+                  sizeof(facts));
+     snprintf(response, BUFFER_SIZE, "250-Listing %.100s\r\n %s250 End\r\n",
+              name, facts);
+}
+
+// OPTS HASH [algorithm] shows or picks the algorithm of HASH
+void cmd_opts(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     if (strcasecmp(tokens[1], "HASH") != 0) {
+          snprintf(response, BUFFER_SIZE, "501 Option not understood.\r\n");
+          return;
+     }
+     if (tokens_count > 2) {
+          int i = 0;
+          while (i < NUM_HASH_ALGORITHMS &&
+                 strcasecmp(tokens[2], hash_names[i]) != 0) {
+               i++;
+          }
+          if (i == NUM_HASH_ALGORITHMS) {
+               snprintf(response, BUFFER_SIZE,
+                        "501 Unknown algorithm, use SHA-256, CRC32C or "
+                        "XXH64.\r\n");
+               return;
+          }
+          session->hash_algorithm = (HashAlgorithm)i;
+     }
+     snprintf(response, BUFFER_SIZE, "200 %s\r\n",
+              hash_names[session->hash_algorithm]);
+}
+
+// The reply of HASH, or of XCRC, which gives CRC-32C in upper case
+void format_digest_reply(char *response, int command,
+                         HashAlgorithm algorithm, const struct stat *st,
+                         char hex[DIGEST_HEX_SIZE], const char *name) {
+     if (command == CMD_XCRC) {
+          for (char *c = hex; *c != '\0'; c++) *c = (char)toupper(*c);
+          snprintf(response, BUFFER_SIZE, "250 %s\r\n", hex);
+     } else {
+          snprintf(response, BUFFER_SIZE, "213 %s 0-%lld %s %.100s\r\n",
+                   hash_names[algorithm], (long long)st->st_size, hex, name);
+     }
+}
+
+// Ends HASH or XCRC with reply; the commands behind it run again
+void finish_digest(Session *session, const char *reply) {
+     close_transfer_file(session);
+     queue_reply(session, reply);
+     session->state = SESSION_READING;
+}
+
+// Reads the next pieces of the file of HASH or XCRC into the digest and
+// replies at the end of the file. Until then run_session queues the session
+// again behind the others after every call.
+void hash_file_chunks(Session *session) {
+     DigestJob *job = session->digest_job;
+     for (int i = 0; i < DIGEST_READS_PER_EVENT; i++) {
+          ssize_t bytes_read = pread(session->file_fd, job->buffer,
+                                     DIGEST_READ_SIZE, job->offset);
+          if (bytes_read > 0) {
+               digest_update(&job->digest, job->buffer, (size_t)bytes_read);
+               job->offset += bytes_read;
+               continue;
+          }
+
+          char reply[BUFFER_SIZE];
+          if (bytes_read < 0) {
+               log_warn("Cannot read %s for its digest: %m", job->name);
+               snprintf(reply, sizeof(reply),
+                        "451 Local error in processing.\r\n");
+          } else {
+               char hex[DIGEST_HEX_SIZE];
+               digest_final(&job->digest, hex);
+               store_digest(session->file_fd, &job->st, job->digest.algorithm,
+                            job->offset, hex);
+               format_digest_reply(reply, job->command, job->digest.algorithm,
+                                   &job->st, hex, job->name);
+          }
+          finish_digest(session, reply);
+          return;
+     }
+}
+
+// HASH and XCRC of a regular file in the current directory. A stored digest
+// is answered at once; otherwise the session reads the file in
+// SESSION_HASHING, a few pieces per turn, and replies when it is done.
+void start_digest(Session *session, const char *name, int command,
+                  HashAlgorithm algorithm, char *response) {
+     int fd = open_beneath(session->dir_fd, name, O_RDONLY | O_CLOEXEC, 0);
+     struct stat st;
+     if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+          if (fd >= 0) close(fd);
+          snprintf(response, BUFFER_SIZE,
+                   "550 File not found or not a regular file.\r\n");
+          return;
+     }
+
+     char hex[DIGEST_HEX_SIZE];
+     if (stored_digest(fd, &st, algorithm, hex)) {
+          metrics_add(digests_stored, 1);
+          close(fd);
+          format_digest_reply(response, command, algorithm, &st, hex, name);
+          return;
+     }
+     DigestJob *job = malloc(sizeof(DigestJob));
+     if (job == NULL) {
+          close(fd);
+          snprintf(response, BUFFER_SIZE,
+                   "451 Local error in processing.\r\n");
+          return;
+     }
+     metrics_add(digests_computed, 1);
+     digest_init(&job->digest, algorithm);
+     job->st = st;
+     job->offset = 0;
+     job->command = command;
+     snprintf(job->name, sizeof(job->name), "%s", name);
+     session->file_fd = fd;
+     session->digest_job = job;
+     session->state = SESSION_HASHING;
+     hash_file_chunks(session);
+}
+
+void cmd_hash(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     start_digest(session, tokens[1], CMD_HASH, session->hash_algorithm,
+                  response);
+}
+
+void cmd_xcrc(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     (void)tokens_count;
+     start_digest(session, tokens[1], CMD_XCRC, HASH_CRC32C, response);
+}
+
+// vsnprintf at the end of text, which stays terminated and within size
+// when the output does not fit
+__attribute__((format(printf, 4, 5))) void appendf(char *text, size_t size,
+                                                   size_t *len,
+                                                   const char *format, ...) {
+     if (*len + 1 >= size) return;
+     va_list args;
+     va_start(args, format);
+     int n = vsnprintf(text + *len, size - *len, format, args);
+     va_end(args);
+     if (n < 0) return;
+     *len += (size_t)n < size - *len ? (size_t)n : size - *len - 1;
+}
+
+double cache_hit_percent(uint64_t hits, uint64_t misses) {
+     return hits + misses > 0 ? 100.0 * (double)hits / (double)(hits + misses)
+                              : 0.0;
+}
+
+// SITE STATS: a summary for the operator, latencies in microseconds
+void site_stats(Session *session) {
+     char reply[MAX_REPLY_SIZE];
+     size_t len = 0;
+     uint64_t hits = atomic_load(&metrics.cache_hits);
+     uint64_t misses = atomic_load(&metrics.cache_misses);
+
+     appendf(reply, sizeof(reply), &len, "211-Server statistics\r\n");
+     appendf(reply, sizeof(reply), &len,
+             " Sessions: %ld active, %llu total; passive ports leased: %ld\r\n",
+             atomic_load(&metrics.sessions_active),
+             (unsigned long long)atomic_load(&metrics.sessions_total),
+             atomic_load(&metrics.pasv_leases));
+     appendf(reply, sizeof(reply), &len,
+             " Transfers: %llu ok, %llu failed; bytes: %llu in, %llu out\r\n",
+             (unsigned long long)atomic_load(&metrics.transfers_ok),
+             (unsigned long long)atomic_load(&metrics.transfers_failed),
+             (unsigned long long)atomic_load(&metrics.bytes_received),
+             (unsigned long long)atomic_load(&metrics.bytes_sent));
+     appendf(reply, sizeof(reply), &len,
+             " Transfer time: p50 %.1f ms, p99 %.1f ms, max %.1f ms; "
+             "median %.1f MB/s\r\n",
+             histogram_quantile(&metrics.transfer_duration, 0.5) / 1e3,
+             histogram_quantile(&metrics.transfer_duration, 0.99) / 1e3,
+             atomic_load(&metrics.transfer_duration.max) / 1e3,
+             histogram_quantile(&metrics.transfer_throughput, 0.5) / 1e6);
+     appendf(reply, sizeof(reply), &len,
+             " Listing cache: %llu hits, %llu misses (%.1f%%)\r\n",
+             (unsigned long long)hits, (unsigned long long)misses,
+             cache_hit_percent(hits, misses));
+     appendf(reply, sizeof(reply), &len,
+             " Logins: %llu ok, %llu failed, %llu from the auth cache\r\n",
+             (unsigned long long)atomic_load(&metrics.logins_ok),
+             (unsigned long long)atomic_load(&metrics.logins_failed),
+             (unsigned long long)atomic_load(&metrics.auth_cache_hits));
+     appendf(reply, sizeof(reply), &len,
+             " Digests: %llu stored, %llu computed\r\n",
+             (unsigned long long)atomic_load(&metrics.digests_stored),
+             (unsigned long long)atomic_load(&metrics.digests_computed));
+     hits = atomic_load(&metrics.file_cache_hits);
+     misses = atomic_load(&metrics.file_cache_misses);
+     appendf(reply, sizeof(reply), &len,
+             " File cache: %llu hits, %llu misses (%.1f%%), %llu evictions\r\n",
+             (unsigned long long)hits, (unsigned long long)misses,
+             cache_hit_percent(hits, misses),
+             (unsigned long long)atomic_load(&metrics.file_cache_evictions));
+     appendf(reply, sizeof(reply), &len,
+             " Command      count       p50       p99     p99.9       max\r\n");
+     for (int i = 0; i < NUM_COMMANDS; i++) {
+          Histogram *latency = &metrics.command_latency[i];
+          uint64_t count = atomic_load(&latency->count);
+          // Keeps room for the last line
+          if (count == 0 || sizeof(reply) - len < 128) continue;
+          appendf(reply, sizeof(reply), &len,
+                  " %-4s %13llu %9.1f %9.1f %9.1f %9.1f\r\n", commands[i].name,
+                  (unsigned long long)count,
+                  histogram_quantile(latency, 0.5) / 1e3,
+                  histogram_quantile(latency, 0.99) / 1e3,
+                  histogram_quantile(latency, 0.999) / 1e3,
+                  atomic_load(&latency->max) / 1e3);
+     }
+     appendf(reply, sizeof(reply), &len,
+             "211 End (latencies in microseconds)\r\n");
+     queue_reply(session, reply);
+}
+
+// FNV-1a, spreads user names and addresses over a rate table
+unsigned rate_hash(const char *key) {
+     uint32_t hash = 2166136261u;
+     for (; *key != '\0'; key++) {
+          hash = (hash ^ (unsigned char)*key) * 16777619u;
+     }
+     return hash % RATE_TABLE_SIZE;
+}
+
+// Finds the entry of key, or adds one that follows the defaults. Called
+// with rate_lock held.
+RateEntry *rate_entry(RateTable *table, const char *key) {
+     char name[RATE_KEY_SIZE];
+     snprintf(name, sizeof(name), "%s", key);
+     if (strcmp(name, "*") == 0) return &table->fallback;
+
+     unsigned slot = rate_hash(name);
+     RateEntry *entry = table->entries[slot];
+     while (entry != NULL && strcmp(entry->key, name) != 0) {
+          entry = entry->next;
+     }
+     if (entry != NULL) return entry;
+
+     entry = calloc(1, sizeof(RateEntry));
+     // Without memory the key shares the bucket of the defaults
+     if (entry == NULL) return &table->fallback;
+     memcpy(entry->key, name, sizeof(name));
+     entry->rate = -1;
+     entry->next = table->entries[slot];
+     table->entries[slot] = entry;
+     return entry;
+}
+
+// Frees the entry once nothing sets or holds it. Called with rate_lock
+// held.
+void rate_drop(RateTable *table, RateEntry *entry) {
+     if (entry == &table->fallback || entry->transfers > 0 ||
+         entry->rate >= 0 || entry->weight > 0) {
+          return;
+     }
+     RateEntry **link = &table->entries[rate_hash(entry->key)];
+     while (*link != entry) link = &(*link)->next;
+     *link = entry->next;
+     free(entry);
+}
+
+long long entry_rate(RateTable *table, RateEntry *entry) {
+     return entry->rate >= 0 ? entry->rate : table->fallback.rate;
+}
+
+int entry_weight(RateTable *table, RateEntry *entry) {
+     return entry->weight > 0 ? entry->weight : table->fallback.weight;
+}
+
+// Adds what a bucket earned since its last refill, up to RATE_BURST_MS
+// worth of its rate. Returns the bytes it allows, SIZE_MAX without a limit.
+size_t refill(double *tokens, uint64_t *refilled, long long rate,
+              uint64_t now) {
+     if (rate <= 0) return SIZE_MAX;
+     double burst = (double)rate * RATE_BURST_MS / 1000;
+     if (burst < RATE_MIN_GRANT) burst = RATE_MIN_GRANT;
+     *tokens += (double)rate * (double)(now - *refilled) / 1e9;
+     if (*tokens > burst) *tokens = burst;
+     *refilled = now;
+     return *tokens > 0 ? (size_t)*tokens : 0;
+}
+
+// What the limits of the user and the address of the session allow now
+size_t rate_caps(Session *session, uint64_t now) {
+     RateEntry *user = session->rate_user;
+     RateEntry *host = session->rate_host;
+     size_t by_user = refill(&user->tokens, &user->refilled,
+                             entry_rate(&rate_users, user), now);
+     size_t by_host = refill(&host->tokens, &host->refilled,
+                             entry_rate(&rate_hosts, host), now);
+     return by_user < by_host ? by_user : by_host;
+}
+
+// Share of the global limit a session takes per turn
+size_t rate_quantum(Session *session) {
+     return (size_t)RATE_QUANTUM *
+            (size_t)entry_weight(&rate_users, session->rate_user);
+}
+
+// Queues the session for its turn and keeps the scheduler ticking while
+// anyone waits. Called with rate_lock held.
+void rate_park(Session *session) {
+     if (session->rate_parked) return;
+     session->rate_parked = true;
+     session->rate_next = NULL;
+     *rate_waiters_tail = session;
+     rate_waiters_tail = &session->rate_next;
+
+     if (!rate_timer_armed) {
+          struct itimerspec tick = {{0, RATE_TICK_MS * 1000000L},
+                                    {0, RATE_TICK_MS * 1000000L}};
+          timerfd_settime(rate_timer_fd, 0, &tick, NULL);
+          rate_timer_armed = true;
+     }
+}
+
+// Takes the session off the list at link. Called with rate_lock held.
+void rate_unlink(Session **link) {
+     Session *session = *link;
+     *link = session->rate_next;
+     if (rate_waiters_tail == &session->rate_next) rate_waiters_tail = link;
+     session->rate_parked = false;
+}
+
+// Bytes the transfer of the session may move now, at most want. Returns 0
+// after parking the session, which the scheduler wakes once it may go on.
+size_t rate_budget(Session *session, size_t want) {
+     if (!atomic_load(&rate_limited)) return want;
+
+     pthread_mutex_lock(&rate_lock);
+     uint64_t now = monotonic_ns();
+     if (session->rate_user == NULL) {
+          // Users that have not logged in share the anonymous limit
+          char host[INET_ADDRSTRLEN];
+          inet_ntop(AF_INET, &session->peer_addr, host, sizeof(host));
+          session->rate_user = rate_entry(
+              &rate_users, session->client_session.authenticated
+                               ? session->client_session.username
+                               : "anonymous");
+          session->rate_host = rate_entry(&rate_hosts, host);
+          session->rate_user->transfers++;
+          session->rate_host->transfers++;
+     }
+
+     size_t needed = want < RATE_MIN_GRANT ? want : RATE_MIN_GRANT;
+     size_t allowed = rate_caps(session, now);
+     if (session->rate_parked || allowed < needed) {
+          allowed = 0;
+     } else if (session->rate_credit > 0) {
+          if (allowed > session->rate_credit) allowed = session->rate_credit;
+     } else if (global_rate > 0) {
+          size_t global =
+              refill(&global_tokens, &global_refilled, global_rate, now);
+          size_t quantum = rate_quantum(session);
+          // Sessions already waiting get their turn first
+          if (rate_waiters != NULL || global < needed) allowed = 0;
+          if (allowed > global) allowed = global;
+          if (allowed > quantum) allowed = quantum;
+     }
+     if (allowed > want) allowed = want;
+     if (allowed == 0) rate_park(session);
+     pthread_mutex_unlock(&rate_lock);
+     return allowed;
+}
+
+// Takes the bytes a transfer moved out of the buckets it drew them from
+void rate_charge(Session *session, size_t bytes) {
+     if (bytes == 0 || session->rate_user == NULL) return;
+
+     pthread_mutex_lock(&rate_lock);
+     if (entry_rate(&rate_users, session->rate_user) > 0) {
+          session->rate_user->tokens -= (double)bytes;
+     }
+     if (entry_rate(&rate_hosts, session->rate_host) > 0) {
+          session->rate_host->tokens -= (double)bytes;
+     }
+     if (session->rate_credit > 0) {
+          session->rate_credit -=
+              bytes < session->rate_credit ? bytes : session->rate_credit;
+     } else if (global_rate > 0) {
+          global_tokens -= (double)bytes;
+     }
+     pthread_mutex_unlock(&rate_lock);
+}
+
+// Takes a finished or closed transfer out of the scheduler; bandwidth set
+// aside for it goes back to the others
+void rate_release(Session *session) {
+     if (session->rate_user == NULL) return;
+
+     pthread_mutex_lock(&rate_lock);
+     if (session->rate_parked) {
+          Session **link = &rate_waiters;
+          while (*link != session) link = &(*link)->rate_next;
+          rate_unlink(link);
+     }
+     if (global_rate > 0) global_tokens += (double)session->rate_credit;
+     session->rate_credit = 0;
+     session->rate_user->transfers--;
+     session->rate_host->transfers--;
+     rate_drop(&rate_users, session->rate_user);
+     rate_drop(&rate_hosts, session->rate_host);
+     session->rate_user = NULL;
+     session->rate_host = NULL;
+     pthread_mutex_unlock(&rate_lock);
+}
+
+// Called with rate_lock held after a limit changed
+void update_rate_limited() {
+     bool limited = global_rate > 0 || rate_users.fallback.rate > 0 ||
+                    rate_hosts.fallback.rate > 0;
+     RateTable *tables[] = {&rate_users, &rate_hosts};
+     for (int t = 0; t < 2 && !limited; t++) {
+          for (int i = 0; i < RATE_TABLE_SIZE && !limited; i++) {
+               for (RateEntry *entry = tables[t]->entries[i];
+                    entry != NULL && !limited; entry = entry->next) {
+                    limited = entry->rate > 0;
+               }
+          }
+     }
+     atomic_store(&rate_limited, limited);
+}
+
+// A byte count or rate, with an optional K, M or G suffix (powers of
+// 1024). Returns -1 if text is not one.
+long long parse_bytes(const char *text) {
+     char *end = NULL;
+     long long value = strtoll(text, &end, 10);
+     if (end == text || value < 0) return -1;
+     long long unit = 1;
+     switch (toupper((unsigned char)*end)) {
+          case '\0': break;
+          case 'K': unit = 1024; break;
+          case 'M': unit = 1024 * 1024; break;
+          case 'G': unit = 1024 * 1024 * 1024; break;
+          default: return -1;
+     }
+     if (unit > 1 && end[1] != '\0') return -1;
+     if (value > LLONG_MAX / unit) return -1;
+     return value * unit;
+}
+
+// Weights only apply to users
+void append_rate_entries(char *reply, size_t size, size_t *len,
+                         RateTable *table) {
+     bool weighted = table == &rate_users;
+     appendf(reply, size, len, " %s * %lld", table->name,
+             table->fallback.rate);
+     if (weighted) {
+          appendf(reply, size, len, " weight %d", table->fallback.weight);
+     }
+     appendf(reply, size, len, "\r\n");
+     for (int i = 0; i < RATE_TABLE_SIZE; i++) {
+          for (RateEntry *entry = table->entries[i]; entry != NULL;
+               entry = entry->next) {
+               // Keeps room for the last line
+               if (size - *len < 128) return;
+               if (entry->rate < 0 && entry->weight == 0) continue;
+               appendf(reply, size, len, " %s %s %lld", table->name,
+                       entry->key, entry_rate(table, entry));
+               if (weighted) {
+                    appendf(reply, size, len, " weight %d",
+                            entry_weight(table, entry));
+               }
+               appendf(reply, size, len, "\r\n");
+          }
+     }
+}
+
+bool is_admin(Session *session) {
+     return session->client_session.authenticated &&
+            strcmp(session->client_session.username, admin_user) == 0;
+}
+
+// SITE LIMIT shows the limits; SITE LIMIT GLOBAL <rate>, USER <name> <rate>
+// and IP <address> <rate> change them. A name or address of * sets the
+// default, a rate of "default" goes back to it.
+void site_limit(Session *session, char *tokens[], int tokens_count,
+                char *response) {
+     if (tokens_count == 2) {
+          char reply[MAX_REPLY_SIZE];
+          size_t len = 0;
+          appendf(reply, sizeof(reply), &len,
+                  "211-Bandwidth limits in bytes per second, 0 for none\r\n");
+          pthread_mutex_lock(&rate_lock);
+          appendf(reply, sizeof(reply), &len, " GLOBAL %lld\r\n",
+                  global_rate);
+          append_rate_entries(reply, sizeof(reply), &len, &rate_users);
+          append_rate_entries(reply, sizeof(reply), &len, &rate_hosts);
+          pthread_mutex_unlock(&rate_lock);
+          appendf(reply, sizeof(reply), &len, "211 End\r\n");
+          queue_reply(session, reply);
+          return;
+     }
+     if (!is_admin(session)) {
+          snprintf(response, BUFFER_SIZE,
+                   "550 Only %s may change the limits.\r\n", admin_user);
+          return;
+     }
+     // Each copy of --processes has its own buckets, a limit set in one
+     // would let the others through N times over
+     if (num_processes > 1) {
+          snprintf(response, BUFFER_SIZE,
+                   "504 Limits are not shared by the %d server processes."
+                   "\r\n",
+                   num_processes);
+          return;
+     }
+
+     RateTable *table = NULL;
+     const char *value = tokens[tokens_count - 1];
+     struct in_addr addr;
+     bool valid = false;
+     if (tokens_count == 4 && strcasecmp(tokens[2], "GLOBAL") == 0) {
+          valid = true;
+     } else if (tokens_count == 5 && strcasecmp(tokens[2], "USER") == 0) {
+          table = &rate_users;
+          valid = true;
+     } else if (tokens_count == 5 && strcasecmp(tokens[2], "IP") == 0) {
+          table = &rate_hosts;
+          valid = strcmp(tokens[3], "*") == 0 ||
+                  inet_pton(AF_INET, tokens[3], &addr) == 1;
+     }
+     // Only entries of their own can go back to the default
+     bool to_default = table != NULL && strcmp(tokens[3], "*") != 0 &&
+                       strcasecmp(value, "default") == 0;
+     long long rate = to_default ? -1 : parse_bytes(value);
+     if (!valid || (rate < 0 && !to_default)) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 Usage: SITE LIMIT [GLOBAL <rate> | USER <name> <rate>"
+                   " | IP <address> <rate>]\r\n");
+          return;
+     }
+
+     pthread_mutex_lock(&rate_lock);
+     if (table == NULL) {
+          global_rate = rate;
+     } else {
+          RateEntry *entry = rate_entry(table, tokens[3]);
+          entry->rate = rate;
+          rate_drop(table, entry);
+     }
+     update_rate_limited();
+     pthread_mutex_unlock(&rate_lock);
+     log_info("%s set the %s limit of %s to %lld bytes per second",
+              session->client_session.username,
+              table != NULL ? table->name : "GLOBAL",
+              table != NULL ? tokens[3] : "all transfers", rate);
+     snprintf(response, BUFFER_SIZE, "200 Limit set.\r\n");
+}
+
+// SITE WEIGHT <name> <weight>: the share of the global limit the transfers
+// of a user get while others wait for it too
+void site_weight(Session *session, char *tokens[], int tokens_count,
+                 char *response) {
+     if (!is_admin(session)) {
+          snprintf(response, BUFFER_SIZE,
+                   "550 Only %s may change the weights.\r\n", admin_user);
+          return;
+     }
+     if (num_processes > 1) {
+          snprintf(response, BUFFER_SIZE,
+                   "504 Weights are not shared by the %d server processes."
+                   "\r\n",
+                   num_processes);
+          return;
+     }
+     bool to_default = tokens_count == 4 && strcmp(tokens[2], "*") != 0 &&
+                       strcasecmp(tokens[3], "default") == 0;
+     long long weight = tokens_count == 4 ? parse_size(tokens[3]) : -1;
+     if (!to_default && (weight < 1 || weight > RATE_MAX_WEIGHT)) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 Usage: SITE WEIGHT <name> <1-%d>\r\n",
+                   RATE_MAX_WEIGHT);
+          return;
+     }
+
+     pthread_mutex_lock(&rate_lock);
+     RateEntry *entry = rate_entry(&rate_users, tokens[2]);
+     entry->weight = to_default ? 0 : (int)weight;
+     rate_drop(&rate_users, entry);
+     pthread_mutex_unlock(&rate_lock);
+     snprintf(response, BUFFER_SIZE, "200 Weight set.\r\n");
+}
+
+// SITE TAR <dir>: sends the directory and everything below it as one tar
+// archive, made while it is sent. Entries are named after the last
+// component of dir, without it for "." and "..".
+void site_tar(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     if (tokens_count < 3) {
+          snprintf(response, BUFFER_SIZE, "501 Usage: SITE TAR <dir>\r\n");
+          return;
+     }
+     if (session->block_mode) {
+          snprintf(response, BUFFER_SIZE,
+                   "504 SITE TAR is only sent in stream mode.\r\n");
+          return;
+     }
+     TarWalk *tar = calloc(1, sizeof(TarWalk));
+     int dir_fd = open_beneath(session->dir_fd, tokens[2],
+                               O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+     if (tar == NULL || dir_fd < 0) {
+          free(tar);
+          if (dir_fd >= 0) close(dir_fd);
+          snprintf(response, BUFFER_SIZE,
+                   "550 Directory not found or access denied.\r\n");
+          return;
+     }
+
+     char *name = tokens[2];
+     size_t len = strlen(name);
+     while (len > 1 && name[len - 1] == '/') name[--len] = '\0';
+     char *base = strrchr(name, '/');
+     base = base != NULL ? base + 1 : name;
+     if (strcmp(base, ".") != 0 && strcmp(base, "..") != 0) {
+          snprintf(tar->path, sizeof(tar->path), "%.200s/", base);
+     }
+     tar->dir_fds[0] = dir_fd;
+     tar->path_lens[0] = strlen(tar->path);
+     tar->depth = 1;
+
+     session->tar = tar;
+     session->dirents_len = 0;
+     session->dirents_pos = 0;
+     session->send_method = SEND_SENDFILE;
+     log_debug("SITE TAR %s", tokens[2]);
+     begin_data_transfer(session, CMD_SITE, response);
+}
+
+void cmd_site(Session *session, char *tokens[], int tokens_count,
+              char *response) {
+     if (strcasecmp(tokens[1], "STATS") == 0) {
+          site_stats(session);
+     } else if (strcasecmp(tokens[1], "LIMIT") == 0) {
+          site_limit(session, tokens, tokens_count, response);
+     } else if (strcasecmp(tokens[1], "WEIGHT") == 0) {
+          site_weight(session, tokens, tokens_count, response);
+     } else if (strcasecmp(tokens[1], "TAR") == 0) {
+          site_tar(session, tokens, tokens_count, response);
+     } else {
+          snprintf(response, BUFFER_SIZE,
+                   "504 SITE %.100s not implemented.\r\n", tokens[1]);
+     }
+}
+
+// Verbs without a handler are recognized but answered with 502
+const Command commands[NUM_COMMANDS] = {
+    [CMD_USER] = {"USER", cmd_user, 1, false},
+    [CMD_PASS] = {"PASS", cmd_pass, 1, false},
+    [CMD_ACCT] = {"ACCT", NULL, 0, false},
+    [CMD_CWD] = {"CWD", cmd_cwd, 1, false},
+    [CMD_CDUP] = {"CDUP", NULL, 0, false},
+    [CMD_SMNT] = {"SMNT", NULL, 0, false},
+    [CMD_QUIT] = {"QUIT", cmd_quit, 0, false},
+    [CMD_REIN] = {"REIN", NULL, 0, false},
+    [CMD_PORT] = {"PORT", NULL, 0, false},
+    [CMD_PASV] = {"PASV", cmd_pasv, 0, false},
+    [CMD_TYPE] = {"TYPE", cmd_type, 0, false},
+    [CMD_STRU] = {"STRU", NULL, 0, false},
+    [CMD_MODE] = {"MODE", cmd_mode, 1, false},
+    [CMD_RETR] = {"RETR", cmd_retr, 1, false},
+    [CMD_STOR] = {"STOR", cmd_stor, 1, false},
+    [CMD_DELE] = {"DELE", NULL, 0, false},
+    [CMD_RNFR] = {"RNFR", NULL, 0, false},
+    [CMD_RNTO] = {"RNTO", NULL, 0, false},
+    [CMD_ABOR] = {"ABOR", cmd_abor, 0, false},
+    [CMD_LIST] = {"LIST", cmd_list, 0, false},
+    [CMD_NLST] = {"NLST", cmd_nlst, 0, false},
+    [CMD_SITE] = {"SITE", cmd_site, 1, true},
+    [CMD_SYST] = {"SYST", NULL, 0, false},
+    [CMD_STAT] = {"STAT", NULL, 0, false},
+    [CMD_HELP] = {"HELP", cmd_help, 0, false},
+    [CMD_NOOP] = {"NOOP", cmd_noop, 0, false},
+    [CMD_PWD] = {"PWD", cmd_pwd, 0, false},
+    [CMD_MKD] = {"MKD", cmd_mkd, 1, false},
+    [CMD_RMD] = {"RMD", cmd_rmd, 1, false},
+    [CMD_ALLO] = {"ALLO", cmd_allo, 1, false},
+    [CMD_REST] = {"REST", cmd_rest, 1, false},
+    [CMD_SIZE] = {"SIZE", cmd_size, 1, false},
+    [CMD_MDTM] = {"MDTM", cmd_mdtm, 1, false},
+    [CMD_MFMT] = {"MFMT", cmd_mfmt, 2, false},
+    [CMD_RANG] = {"RANG", cmd_rang, 2, false},
+    [CMD_MLSD] = {"MLSD", cmd_mlsd, 0, false},
+    [CMD_MLST] = {"MLST", cmd_mlst, 0, false},
+    [CMD_OPTS] = {"OPTS", cmd_opts, 1, false},
+    [CMD_HASH] = {"HASH", cmd_hash, 1, false},
+    [CMD_XCRC] = {"XCRC", cmd_xcrc, 1, false},
+};
+
+void execute_command(Session *session, char *tokens[], int tokens_count,
+                     char *response) {
+     int command_id = find_command(pack_verb(tokens[0]));
+     if (command_id < 0) {
+          metrics_add(unknown_commands, 1);
+          snprintf(response, BUFFER_SIZE, "500 Invalid command!\r\n");
+          return;
+     }
+
+     uint64_t started = monotonic_ns();
+     const Command *command = &commands[command_id];
+     if (command->handler == NULL) {
+          snprintf(response, BUFFER_SIZE,
+                   "502 Command: %s not implemented \r\n", command->name);
+     } else if (command->needs_login &&
+                !session->client_session.authenticated) {
+          snprintf(response, BUFFER_SIZE, "530 Not logged in.\r\n");
+     } else if (tokens_count - 1 < command->min_args) {
+          snprintf(response, BUFFER_SIZE,
+                   "501 Syntax error in parameters or arguments.\r\n");
+     } else {
+          command->handler(session, tokens, tokens_count, response);
+     }
+     histogram_record(&metrics.command_latency[command_id],
+                      monotonic_ns() - started);
+}
+
+void close_pipe(Session *session) {
+     if (session->pipe_fds[0] < 0) return;
+     close(session->pipe_fds[0]);
+     close(session->pipe_fds[1]);
+     session->pipe_fds[0] = -1;
+     session->pipe_fds[1] = -1;
+     session->pipe_len = 0;
+}
+
+// Transfers that never got a data connection only count as failed
+void record_transfer(Session *session, bool ok) {
+     if (!ok) metrics_add(transfers_failed, 1);
+     if (session->transfer_started == 0) return;
+
+     uint64_t bytes = (uint64_t)session->bytes_transferred;
+     if (session->transfer_command == CMD_STOR)
+          metrics_add(bytes_received, bytes);
+     else
+          metrics_add(bytes_sent, bytes);
+     if (ok) {
+          uint64_t elapsed = monotonic_ns() - session->transfer_started;
+          metrics_add(transfers_ok, 1);
+          histogram_record(&metrics.transfer_duration, elapsed / 1000);
+          if (elapsed > 0) {
+               histogram_record(&metrics.transfer_throughput,
+                                bytes * 1000000000ull / elapsed);
+          }
+     }
+     session->transfer_started = 0;
+}
+
+void finish_transfer(Session *session, const char *reply) {
+     stop_data_deadline(session);
+     record_transfer(session, reply[0] == '2');
+     rate_release(session);
+     // In block mode the connection stays for the next transfer, unless
+     // this one failed halfway through a block
+     if (session->block_mode && reply[0] == '2') {
+          set_interest(&session->data, 0);
+     } else {
+          close_data_socket(session);
+     }
+     if (session->transfer_command == CMD_STOR && session->file_fd >= 0) {
+          file_cache_forget(session->file_fd);
+          forget_digests(session->file_fd);
+     }
+     close_transfer_file(session);
+     if (session->transfer_command == CMD_STOR) {
+          invalidate_session_path(session, session->file_path);
+     }
+     // An aborted transfer may leave data in the pipe, which must not leak
+     // into the next one
+     if (session->pipe_len > 0) close_pipe(session);
+     queue_reply(session, reply);
+     session->state = SESSION_READING;
+}
+
+void close_session(Session *session) {
+     if (session->closed) return;
+
+     log_info("Closing client session");
+     metrics_add(sessions_active, -1);
+     close_data_socket(session);
+     close_source(&session->data_timer);
+     release_pasv_port(session);
+     rate_release(session);
+     close_transfer_file(session);
+     close_pipe(session);
+     close_source(&session->control);
+     close(session->dir_fd);
+     session->closed = true;
+}
+
+// Returns -1 if the control connection failed
+int flush_replies(Session *session) {
+     while (session->output_sent < session->output_len) {
+          ssize_t len = send(session->control.fd,
+                             session->output + session->output_sent,
+                             session->output_len - session->output_sent,
+                             MSG_NOSIGNAL);
+          if (len < 0) {
+               if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+               log_warn("Error sending reply: %m");
+               return -1;
+          }
+          session->output_sent += (size_t)len;
+     }
+
+     if (session->output_sent == session->output_len) {
+          session->output_len = 0;
+          session->output_sent = 0;
+     }
+     return 0;
+}
+
+// Takes one complete command line out of the input buffer, if there is
+// one. A line that does not fit in the buffer is dropped up to its end and
+// comes back empty, with too_long set.
+bool next_command_line(Session *session, char *line, bool *too_long) {
+     char *end = memchr(session->input, '\n', session->input_len);
+
+     if (end == NULL) {
+          if (session->input_len == sizeof(session->input) - 1) {
+               session->discarding = true;
+               session->input_len = 0;
+          }
+          return false;
+     }
+     size_t consumed = (size_t)(end - session->input) + 1;
+     *too_long = session->discarding;
+     session->discarding = false;
+
+     size_t len = *too_long ? 0 : consumed;
+     while (len > 0 && (session->input[len - 1] == '\n' ||
+                        session->input[len - 1] == '\r')) {
+          len--;
+     }
+     memcpy(line, session->input, len);
+     line[len] = '\0';
+
+     memmove(session->input, session->input + consumed,
+             session->input_len - consumed);
+     session->input_len -= consumed;
+     return true;
+}
+
+// Whether ABOR or QUIT is among the commands received, which end a transfer
+// still waiting for its data connection, or a digest being read, instead of
+// waiting behind it. The commands then run in order once the transfer or
+// digest has been answered.
+bool cancels_wait(Session *session) {
+     const char *line = session->input;
+     const char *input_end = session->input + session->input_len;
+     const char *end;
+     while ((end = memchr(line, '\n', (size_t)(input_end - line))) != NULL) {
+          char verb[5];
+          size_t len = 0;
+          while (len < 4 && isalpha((unsigned char)line[len])) {
+               verb[len] = line[len];
+               len++;
+          }
+          verb[len] = '\0';
+          int command_id = isspace((unsigned char)line[len])
+                               ? find_command(pack_verb(verb))
+                               : -1;
+          if (command_id == CMD_ABOR || command_id == CMD_QUIT) return true;
+          line = end + 1;
+     }
+     return false;
+}
+
+// Drives the session state machine as far as it can go without blocking.
+// Every complete command in the input buffer runs in order, and their
+// replies go out together in one write.
+void advance_session(Session *session) {
+     char line[BUFFER_SIZE];
+     char response[BUFFER_SIZE];
+     char *tokens[MAX_ARGUMENTS];
+     int tokens_count = 0;
+     bool too_long;
+
+     if (session->state == SESSION_DATA_WAIT && cancels_wait(session)) {
+          finish_transfer(session,
+                          "426 Connection closed; transfer aborted.\r\n");
+     } else if (session->state == SESSION_HASHING && cancels_wait(session)) {
+          finish_digest(session, "426 Digest aborted.\r\n");
+     }
+
+     // A transfer in progress or QUIT stops the batch, the commands after
+     // it wait in the input buffer. So does a client that does not read
+     // its replies.
+     while (session->state == SESSION_READING &&
+            sizeof(session->output) -
+                    (session->output_len - session->output_sent) >=
+                MAX_REPLY_SIZE &&
+            next_command_line(session, line, &too_long)) {
+          split_client_input(line, tokens, &tokens_count);
+
+          for (int i = 0; i < tokens_count; i++) {
+               log_debug("Token[%d]: %s", i, tokens[i]);
+          }
+
+          response[0] = '\0';
+          if (too_long)
+               snprintf(response, BUFFER_SIZE,
+                        "500 Command line too long.\r\n");
+          else if (tokens_count > 0)
+               execute_command(session, tokens, tokens_count, response);
+          else
+               snprintf(response, BUFFER_SIZE, "500 Invalid command!\r\n");
+
+          queue_reply(session, response);
+     }
+
+     if (flush_replies(session) < 0) {
+          close_session(session);
+          return;
+     }
+     if (session->state == SESSION_CLOSING && session->output_len == 0) {
+          close_session(session);
+          return;
+     }
+     update_control_interest(session);
+}
+
+void handle_client(Session *session, uint32_t events) {
+     if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+          size_t room = sizeof(session->input) - 1 - session->input_len;
+          if (room > 0) {
+               ssize_t len = recv(session->control.fd,
+                                  session->input + session->input_len, room, 0);
+               if (len == 0 ||
+                   (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    if (len < 0) log_warn("Error receiving command: %m");
+                    // Commands the client sent before it left still run
+                    if (len == 0) advance_session(session);
+                    close_session(session);
+                    return;
+               }
+               if (len > 0) session->input_len += (size_t)len;
+          }
+     }
+
+     advance_session(session);
+}
+
+// Starts a transfer waiting for its passive data connection once the event
+// loop has handed the connection over
+void handle_pasv_ready(Session *session) {
+     if (session->state != SESSION_DATA_WAIT) return;
+
+     int data_sock = atomic_exchange(&session->pasv_accepted, -1);
+     if (data_sock < 0) return;
+     session->data.fd = data_sock;
+     start_transfer(session);
+     advance_session(session);
+}
+
+// The client did not open the data connection of the waiting transfer in
+// time. A timer that expired just as the transfer started or ended has
+// nothing to read once it was stopped.
+void handle_data_timeout(Session *session) {
+     uint64_t expirations;
+     if (read(session->data_timer.fd, &expirations, sizeof(expirations)) !=
+             sizeof(expirations) ||
+         session->state != SESSION_DATA_WAIT) {
+          return;
+     }
+     log_info("No data connection within %d s", DATA_WAIT_TIMEOUT_S);
+     finish_transfer(session, "425 Can't open data connection.\r\n");
+     advance_session(session);
+}
+
+// Each send_* function moves up to max bytes of the file to the data
+// socket. They return the bytes sent, 0 at the end of the file, or -1 with
+// errno set.
+ssize_t send_with_sendfile(Session *session, size_t max) {
+     return sendfile(session->data.fd, session->file_fd, &session->file_offset,
+                     max);
+}
+
+bool open_pipe(Session *session) {
+     if (session->pipe_fds[0] >= 0) return true;
+     if (pipe2(session->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+          session->pipe_fds[0] = -1;
+          return false;
+     }
+     // Large enough for a whole chunk; the default of 64 KB is not an error
+     fcntl(session->pipe_fds[1], F_SETPIPE_SZ, ZERO_COPY_CHUNK_SIZE);
+     return true;
+}
+
+ssize_t send_with_splice(Session *session, size_t max) {
+     if (!open_pipe(session)) return -1;
+
+     if (session->pipe_len == 0) {
+          ssize_t filled = splice(session->file_fd, &session->file_offset,
+                                  session->pipe_fds[1], NULL, max,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (filled <= 0) return filled;
+          session->pipe_len = (size_t)filled;
+     }
+
+     ssize_t sent = splice(session->pipe_fds[0], NULL, session->data.fd, NULL,
+                           session->pipe_len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+     if (sent > 0) session->pipe_len -= (size_t)sent;
+     return sent;
+}
+
+// A cached file is sent straight from memory. In block mode the pending
+// block header goes out in the same call, ahead of the data. Returns the
+// data bytes sent, 0 at the end of the file.
+ssize_t send_from_cache(Session *session, size_t max) {
+     CacheBlob *blob = session->cached_file;
+     size_t offset = (size_t)session->file_offset;
+     size_t len = offset < blob->len ? blob->len - offset : 0;
+     if (len > max) len = max;
+
+     struct iovec iov[2];
+     int count = 0;
+     size_t header = BLOCK_HEADER_SIZE - session->block_header_len;
+     if (header > 0) {
+          iov[count].iov_base =
+              session->block_header + session->block_header_len;
+          iov[count++].iov_len = header;
+     }
+     if (len == 0 && count == 0) return 0;
+     iov[count].iov_base = blob->data + offset;
+     iov[count++].iov_len = len;
+     struct msghdr message = {.msg_iov = iov, .msg_iovlen = (size_t)count};
+     ssize_t sent = sendmsg(session->data.fd, &message, MSG_NOSIGNAL);
+     if (sent < 0) return -1;
+
+     size_t header_sent = (size_t)sent < header ? (size_t)sent : header;
+     session->block_header_len += header_sent;
+     sent -= (ssize_t)header_sent;
+     if (sent == 0 && len > 0) {
+          // Only part of the header fit, the socket is full
+          errno = EAGAIN;
+          return -1;
+     }
+     session->file_offset += sent;
+     return sent;
+}
+
+ssize_t send_with_buffer(Session *session, size_t max) {
+     if (session->transfer_sent == session->transfer_len) {
+          if (max > sizeof(session->transfer_buffer)) {
+               max = sizeof(session->transfer_buffer);
+          }
+          ssize_t bytes_read = pread(session->file_fd, session->transfer_buffer,
+                                     max, session->file_offset);
+          if (bytes_read <= 0) return bytes_read;
+          session->file_offset += bytes_read;
+          session->transfer_len = (size_t)bytes_read;
+          session->transfer_sent = 0;
+     }
+
+     ssize_t sent = send(session->data.fd,
+                         session->transfer_buffer + session->transfer_sent,
+                         session->transfer_len - session->transfer_sent,
+                         MSG_NOSIGNAL);
+     if (sent > 0) session->transfer_sent += (size_t)sent;
+     return sent;
+}
+
+// io_uring transfer: one system call submits up to URING_BATCH_PAIRS linked
+// pairs of splices, source -> pipe and pipe -> destination, for RETR
+// (file to socket) or STOR (socket to file), filling at most window bytes.
+// Hard links keep the pairs in order even when one of them comes up empty.
+// Returns the bytes that reached the destination, 0 once the source is
+// exhausted and the pipe is empty, or -1 with errno set.
+ssize_t uring_transfer(Session *session, bool sending, size_t window) {
+     if (!open_pipe(session)) return -1;
+     if (window == 0 && session->pipe_len == 0) return 0;
+     // The range is used up, only the pipe is left to drain
+     bool exhausted = window == 0;
+
+     int source = sending ? session->file_fd : session->data.fd;
+     int destination = sending ? session->data.fd : session->file_fd;
+
+     // The splices use the file position, which follows file_offset
+     lseek(session->file_fd, session->file_offset, SEEK_SET);
+
+     bool is_fill[URING_ENTRIES];
+     int count = 0;
+     for (int i = 0; i < URING_BATCH_PAIRS; i++) {
+          size_t len =
+              window < ZERO_COPY_CHUNK_SIZE ? window : ZERO_COPY_CHUNK_SIZE;
+          window -= len;
+
+          // Past the end of the window only what the pipe holds is moved
+          if (len > 0) {
+               struct io_uring_sqe *fill = uring_prepare(
+                   worker_ring, IORING_OP_SPLICE, session->pipe_fds[1]);
+               fill->splice_fd_in = source;
+               fill->splice_off_in = (uint64_t)-1;
+               fill->off = (uint64_t)-1;
+               fill->len = (uint32_t)len;
+               fill->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+               fill->flags = IOSQE_IO_HARDLINK;
+               is_fill[count++] = true;
+          }
+
+          struct io_uring_sqe *drain =
+              uring_prepare(worker_ring, IORING_OP_SPLICE, destination);
+          drain->splice_fd_in = session->pipe_fds[0];
+          drain->splice_off_in = (uint64_t)-1;
+          drain->off = (uint64_t)-1;
+          drain->len = ZERO_COPY_CHUNK_SIZE;
+          drain->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+          is_fill[count++] = false;
+
+          if (len == 0 || i == URING_BATCH_PAIRS - 1) break;
+          drain->flags = IOSQE_IO_HARDLINK;
+     }
+
+     int results[URING_ENTRIES];
+     if (!uring_submit_and_wait(worker_ring, results)) {
+          errno = EIO;
+          return -1;
+     }
+
+     ssize_t moved = 0;
+     int error = 0;
+     for (int i = 0; i < count && error == 0; i++) {
+          int result = results[i];
+
+          if (result > 0) {
+               if (is_fill[i]) {
+                    session->pipe_len += (size_t)result;
+                    if (sending) session->file_offset += result;
+               } else {
+                    session->pipe_len -= (size_t)result;
+                    if (!sending) session->file_offset += result;
+                    moved += result;
+               }
+          } else if (result == 0 && is_fill[i]) {
+               exhausted = true;
+          } else if (result < 0 && result != -EAGAIN) {
+               error = -result;
+          }
+     }
+
+     if (moved > 0) return moved;
+     if (error != 0) {
+          errno = error;
+          return -1;
+     }
+     if (exhausted && session->pipe_len == 0) return 0;
+     errno = EAGAIN;
+     return -1;
+}
+
+// Caps a transfer step at the end of the RANG range, if there is one.
+// Returns 0 once the whole range has been read from the source.
+size_t clamp_to_range(Session *session, size_t max) {
+     if (session->file_end < 0) return max;
+
+     // Upload data waiting in the pipe has been read but not written yet
+     off_t consumed = session->file_offset;
+     if (session->transfer_command == CMD_STOR) consumed += session->pipe_len;
+
+     off_t left = session->file_end - consumed;
+     if (left <= 0) return 0;
+     return (off_t)max < left ? max : (size_t)left;
+}
+
+// Puts the header of the next block in front of the data still to be sent
+void start_block(Session *session, unsigned char descriptor, size_t len) {
+     session->block_header[0] = descriptor;
+     session->block_header[1] = (unsigned char)(len >> 8);
+     session->block_header[2] = (unsigned char)(len & 0xFF);
+     session->block_header_len = 0;
+     session->block_left = len;
+     session->block_eof = descriptor & BLOCK_EOF;
+}
+
+// Sends what is left of the block header. The data follows right behind
+// it, so the header is held back to go out in the same segment. Returns
+// false with errno set if the socket is full or failed.
+bool send_block_header(Session *session) {
+     int flags = MSG_NOSIGNAL | (session->block_left > 0 ? MSG_MORE : 0);
+     while (session->block_header_len < BLOCK_HEADER_SIZE) {
+          ssize_t sent = send(session->data.fd,
+                              session->block_header + session->block_header_len,
+                              BLOCK_HEADER_SIZE - session->block_header_len,
+                              flags);
+          if (sent < 0) return false;
+          session->block_header_len += (size_t)sent;
+     }
+     return true;
+}
+
+// Reads the header of the next block of an upload. Returns the header
+// bytes received, 0 once the client closed the connection, or -1 with
+// errno set (EPROTO for restart markers, which are not supported).
+ssize_t receive_block_header(Session *session) {
+     if (session->block_header_len == BLOCK_HEADER_SIZE) {
+          session->block_header_len = 0;
+     }
+     ssize_t received = recv(session->data.fd,
+                             session->block_header + session->block_header_len,
+                             BLOCK_HEADER_SIZE - session->block_header_len, 0);
+     if (received <= 0) return received;
+
+     session->block_header_len += (size_t)received;
+     if (session->block_header_len < BLOCK_HEADER_SIZE) return received;
+     if (session->block_header[0] & BLOCK_RESTART) {
+          errno = EPROTO;
+          return -1;
+     }
+     session->block_left = (size_t)session->block_header[1] << 8 |
+                           session->block_header[2];
+     session->block_eof = session->block_header[0] & BLOCK_EOF;
+     return received;
+}
+
+// RETR in block mode: once the current block is out, starts the next one.
+// The block that reaches the end of the range carries the EOF flag, so a
+// small file goes out as one header and its data. Returns false with errno
+// set if the header cannot be sent yet.
+bool next_send_block(Session *session) {
+     if (session->block_left == 0 &&
+         session->block_header_len == BLOCK_HEADER_SIZE) {
+          off_t left = session->file_end - session->file_offset;
+          size_t len = left < BLOCK_MAX_DATA ? (size_t)left : BLOCK_MAX_DATA;
+          start_block(session, (off_t)len == left ? BLOCK_EOF : 0, len);
+     }
+     // A cached file sends the header together with the data
+     if (session->send_method == SEND_CACHED && session->block_left > 0) {
+          return true;
+     }
+     return send_block_header(session);
+}
+
+// RETR: move the next part of the file to the client
+void send_file_chunks(Session *session, size_t budget) {
+     while (budget > 0) {
+          size_t window = clamp_to_range(session, budget);
+          if (session->block_mode) {
+               if (session->block_eof && session->block_left == 0 &&
+                   session->block_header_len == BLOCK_HEADER_SIZE) {
+                    finish_transfer(session, "226 Transfer complete.\r\n");
+                    return;
+               }
+               if (!next_send_block(session)) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                    log_warn("Error sending block header: %m");
+                    finish_transfer(session, "426 Connection closed; "
+                                             "transfer aborted.\r\n");
+                    return;
+               }
+               if (session->block_left == 0) continue;  // empty last block
+               // The data of a block never runs into the next header; part
+               // of it may already wait in the pipe
+               size_t block_unread = session->block_left - session->pipe_len;
+               if (window > block_unread) window = block_unread;
+          }
+
+          size_t max =
+              window < ZERO_COPY_CHUNK_SIZE ? window : ZERO_COPY_CHUNK_SIZE;
+          ssize_t sent;
+          if (session->use_uring) {
+               sent = uring_transfer(session, true, window);
+               if (sent < 0 && errno == EINVAL) {
+                    // Data already in the pipe goes out through splice
+                    log_info("RETR falling back from io_uring");
+                    session->use_uring = false;
+                    if (session->pipe_len > 0) {
+                         session->send_method = SEND_SPLICE;
+                    }
+                    continue;
+               }
+          } else if (session->send_method == SEND_SENDFILE) {
+               sent = send_with_sendfile(session, max);
+          } else if (session->send_method == SEND_SPLICE) {
+               sent = send_with_splice(session, max);
+          } else if (session->send_method == SEND_CACHED) {
+               sent = send_from_cache(session, max);
+          } else {
+               sent = send_with_buffer(session, max);
+          }
+
+          if (sent > 0) {
+               session->bytes_transferred += sent;
+               if (session->block_mode) session->block_left -= (size_t)sent;
+               budget -= (size_t)sent < budget ? (size_t)sent : budget;
+               continue;
+          }
+          if (sent == 0 && session->block_mode) {
+               // Shorter than the blocks announced, the client cannot
+               // tell where the file ends
+               log_warn("File shrank while it was sent in block mode");
+               finish_transfer(session, "451 Local error in processing.\r\n");
+               return;
+          }
+          if (sent == 0) {
+               log_debug("Transfer finished, sent %lld bytes",
+                      (long long)session->bytes_transferred);
+               // Inform client that the transfer is complete
+               finish_transfer(session, "226 Transfer complete.\r\n");
+               return;
+          }
+          if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+          // The file or its filesystem does not support this method, the
+          // offset is shared so the next one picks up where it stopped
+          if ((errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) &&
+              session->send_method < SEND_BUFFERED && session->pipe_len == 0) {
+               log_info("RETR falling back from method %d",
+                      session->send_method);
+               session->send_method++;
+               continue;
+          }
+
+          log_warn("Error sending file: %m");
+          finish_transfer(session,
+                          "426 Connection closed; transfer aborted.\r\n");
+          return;
+     }
+}
+
+// Moves what the pipe holds into the file. Filesystems without splice
+// support get the data through the transfer buffer instead.
+bool drain_pipe_to_file(Session *session) {
+     while (session->pipe_len > 0) {
+          ssize_t written = -1;
+          if (session->receive_method == RECEIVE_SPLICE) {
+               written = splice(session->pipe_fds[0], NULL, session->file_fd,
+                                &session->file_offset, session->pipe_len,
+                                SPLICE_F_MOVE);
+               if (written < 0 && errno == EINVAL) {
+                    log_info("STOR falling back to buffered writes");
+                    session->receive_method = RECEIVE_BUFFERED;
+                    continue;
+               }
+          } else {
+               size_t len = session->pipe_len < sizeof(session->transfer_buffer)
+                                ? session->pipe_len
+                                : sizeof(session->transfer_buffer);
+               ssize_t bytes_read =
+                   read(session->pipe_fds[0], session->transfer_buffer, len);
+               if (bytes_read <= 0) return false;
+               written = pwrite(session->file_fd, session->transfer_buffer,
+                                (size_t)bytes_read, session->file_offset);
+               if (written == bytes_read) {
+                    session->file_offset += written;
+               } else {
+                    written = -1;
+               }
+          }
+
+          if (written <= 0) return false;
+          session->pipe_len -= (size_t)written;
+     }
+     return true;
+}
+
+// Each receive_* function moves up to max bytes from the data socket into
+// the file. They return the bytes received, 0 once the client closed the
+// connection, or -1 with errno set (EIO for failed file writes).
+ssize_t receive_with_splice(Session *session, size_t max) {
+     if (!open_pipe(session)) return -1;
+     if (max == 0) return 0;
+
+     ssize_t received = splice(session->data.fd, NULL, session->pipe_fds[1],
+                               NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+     if (received <= 0) return received;
+
+     session->pipe_len = (size_t)received;
+     if (!drain_pipe_to_file(session)) {
+          log_warn("Error writing file: %m");
+          errno = EIO;
+          return -1;
+     }
+     return received;
+}
+
+ssize_t receive_with_buffer(Session *session, size_t max) {
+     if (max > sizeof(session->transfer_buffer)) {
+          max = sizeof(session->transfer_buffer);
+     }
+     // recv of 0 bytes would not tell the end of the range from a closed
+     // connection
+     if (max == 0) return 0;
+
+     ssize_t received =
+         recv(session->data.fd, session->transfer_buffer, max, 0);
+     if (received <= 0) return received;
+
+     ssize_t written = pwrite(session->file_fd, session->transfer_buffer,
+                              (size_t)received, session->file_offset);
+     if (written != received) {
+          log_warn("Error writing file: %m");
+          errno = EIO;
+          return -1;
+     }
+     session->file_offset += written;
+     return received;
+}
+
+// Starts writeback of the completed window without waiting for it, so the
+// disk works on it while the next window comes in from the network
+void write_behind(Session *session) {
+     off_t pending = session->file_offset - session->writeback_offset;
+     if (pending < WRITE_BEHIND_WINDOW) return;
+
+     sync_file_range(session->file_fd, session->writeback_offset, pending,
+                     SYNC_FILE_RANGE_WRITE);
+     session->writeback_offset = session->file_offset;
+}
+
+// STOR: move the next part of the upload into the file
+void receive_file_chunks(Session *session, size_t budget) {
+     while (budget > 0) {
+          size_t window = clamp_to_range(session, budget);
+          // The data of a block never runs into the next header
+          if (session->block_mode && window > session->block_left) {
+               window = session->block_left;
+          }
+          size_t max =
+              window < ZERO_COPY_CHUNK_SIZE ? window : ZERO_COPY_CHUNK_SIZE;
+          ssize_t received;
+          if (session->block_mode && session->block_left == 0) {
+               if (session->block_eof) {
+                    finish_transfer(session, "226 Transfer complete.\r\n");
+                    return;
+               }
+               received = receive_block_header(session);
+               if (received > 0) continue;
+          } else if (session->use_uring) {
+               received = uring_transfer(session, false, window);
+               if (received < 0 && errno == EINVAL) {
+                    // Whatever is left in the pipe is drained by the
+                    // regular path
+                    log_info("STOR falling back from io_uring");
+                    session->use_uring = false;
+                    if (!drain_pipe_to_file(session)) {
+                         finish_transfer(session, "451 Local error in "
+                                                  "processing.\r\n");
+                         return;
+                    }
+                    continue;
+               }
+          } else if (session->receive_method == RECEIVE_SPLICE) {
+               received = receive_with_splice(session, max);
+          } else {
+               received = receive_with_buffer(session, max);
+          }
+
+          if (received > 0) {
+               session->bytes_transferred += received;
+               if (session->block_mode) {
+                    session->block_left -= (size_t)received;
+               }
+               budget -= (size_t)received < budget ? (size_t)received : budget;
+               write_behind(session);
+               continue;
+          }
+          if (received == 0 && session->block_mode) {
+               log_warn("Data connection closed before the last block");
+               finish_transfer(session,
+                               "426 Connection closed; transfer aborted.\r\n");
+               return;
+          }
+          if (received == 0) {
+               log_debug("Transfer finished, received %lld bytes",
+                      (long long)session->bytes_transferred);
+               finish_transfer(session, "226 Transfer complete.\r\n");
+               return;
+          }
+          if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+          // Sockets that cannot be spliced fall back to recv
+          if (errno == EINVAL && session->receive_method == RECEIVE_SPLICE) {
+               log_info("STOR falling back to buffered receives");
+               session->receive_method = RECEIVE_BUFFERED;
+               continue;
+          }
+
+          log_warn("Error receiving file: %m");
+          finish_transfer(session,
+                          "426 Connection closed; transfer aborted.\r\n");
+          return;
+     }
+}
+
+// LIST/NLST/MLSD: stream the next entries of the directory to the client
+void send_listing_chunks(Session *session) {
+     for (int i = 0; i < TRANSFER_CHUNKS_PER_EVENT; i++) {
+          if (session->transfer_sent == session->transfer_len &&
+              session->block_header_len == BLOCK_HEADER_SIZE) {
+               // In block mode only the empty last block ends the listing
+               ssize_t filled = session->block_eof ? 0 : fill_listing(session);
+               if (filled == 0 &&
+                   (!session->block_mode || session->block_eof)) {
+                    log_debug("Listing finished, sent %lld bytes",
+                           (long long)session->bytes_transferred);
+                    finish_transfer(session, "226 Directory send OK.\r\n");
+                    return;
+               }
+               if (filled < 0) {
+                    log_warn("Error reading directory: %m");
+                    finish_transfer(session,
+                                    "451 Local error in processing.\r\n");
+                    return;
+               }
+               // Every batch goes out as one block
+               if (session->block_mode) {
+                    start_block(session, filled == 0 ? BLOCK_EOF : 0,
+                                (size_t)filled);
+               }
+          }
+
+          ssize_t sent = 0;
+          if (session->block_mode && !send_block_header(session)) {
+               sent = -1;
+          } else if (session->transfer_sent < session->transfer_len) {
+               sent = send(session->data.fd,
+                           session->transfer_buffer + session->transfer_sent,
+                           session->transfer_len - session->transfer_sent,
+                           MSG_NOSIGNAL);
+          }
+          if (sent < 0) {
+               if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+               log_warn("Error sending listing: %m");
+               finish_transfer(session,
+                               "426 Connection closed; transfer aborted.\r\n");
+               return;
+          }
+          session->transfer_sent += (size_t)sent;
+          session->bytes_transferred += sent;
+     }
+}
+
+// Writes value into a numeric field of a tar header: octal digits and a
+// NUL, or base-256 for sizes beyond what the digits hold (over 8 GB)
+void tar_number(char *field, size_t size, unsigned long long value) {
+     if (value >> (3 * (size - 1)) == 0) {
+          snprintf(field, size, "%0*llo", (int)size - 1, value);
+          return;
+     }
+     memset(field, 0, size);
+     field[0] = (char)0x80;
+     for (size_t i = size - 1; i > 0 && value > 0; i--, value >>= 8) {
+          field[i] = (char)(value & 0xFF);
+     }
+}
+
+// Appends one ustar header block to the transfer buffer
+void append_tar_block(Session *session, const char *name, size_t name_len,
+                      const char *prefix, size_t prefix_len,
+                      const struct stat *st, off_t size, char type,
+                      const char *link) {
+     char *header = session->transfer_buffer + session->transfer_len;
+     memset(header, 0, TAR_BLOCK_SIZE);
+     memcpy(header, name, name_len);
+     tar_number(header + 100, 8, st->st_mode & 07777);
+     tar_number(header + 108, 8, st->st_uid);
+     tar_number(header + 116, 8, st->st_gid);
+     tar_number(header + 124, 12, (unsigned long long)size);
+     tar_number(header + 136, 12, (unsigned long long)st->st_mtime);
+     header[156] = type;
+     if (link != NULL) memcpy(header + 157, link, strlen(link));
+     memcpy(header + 257, "ustar\0" "00", 8);
+     memcpy(header + 345, prefix, prefix_len);
+
+     // The checksum is taken with its own field filled with spaces
+     unsigned checksum = 8 * ' ';
+     for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+          if (i < 148 || i >= 156) checksum += (unsigned char)header[i];
+     }
+     snprintf(header + 148, 8, "%06o", checksum);
+     header[155] = ' ';
+     session->transfer_len += TAR_BLOCK_SIZE;
+}
+
+// Appends the header of an entry, whose archive path is the one of the
+// walk. A path that fits neither the name field nor the prefix and name
+// fields goes first in a GNU long name entry.
+void append_tar_header(Session *session, const struct stat *st, off_t size,
+                       char type, const char *link) {
+     const char *path = session->tar->path;
+     size_t len = strlen(path);
+     if (len <= 100) {
+          append_tar_block(session, path, len, "", 0, st, size, type, link);
+          return;
+     }
+     const char *split = memchr(path + len - 101, '/', 101);
+     if (split != NULL && split > path && split < path + len - 1 &&
+         split - path <= 155) {
+          append_tar_block(session, split + 1, len - (size_t)(split - path) - 1,
+                           path, (size_t)(split - path), st, size, type, link);
+          return;
+     }
+     append_tar_block(session, "././@LongLink", 13, "", 0, st,
+                      (off_t)len + 1, 'L', NULL);
+     char *name = session->transfer_buffer + session->transfer_len;
+     size_t blocks = (len + TAR_BLOCK_SIZE) / TAR_BLOCK_SIZE;
+     memset(name, 0, blocks * TAR_BLOCK_SIZE);
+     memcpy(name, path, len);
+     session->transfer_len += blocks * TAR_BLOCK_SIZE;
+     append_tar_block(session, path, 100, "", 0, st, size, type, link);
+}
+
+// Formats the next headers of the archive into the transfer buffer, walking
+// the tree with getdents64. Stops after the header of a regular file, whose
+// body then goes out from file_fd. Returns the bytes formatted, 0 once the
+// archive is complete, or -1 with errno set.
+ssize_t fill_tar(Session *session) {
+     TarWalk *tar = session->tar;
+     session->transfer_len = 0;
+     session->transfer_sent = 0;
+     if (tar->padding > 0) {
+          memset(session->transfer_buffer, 0, (size_t)tar->padding);
+          session->transfer_len = (size_t)tar->padding;
+          tar->padding = 0;
+     }
+     struct stat st;
+     if (!tar->started) {
+          tar->started = true;
+          if (tar->path[0] != '\0' && fstat(tar->dir_fds[0], &st) == 0) {
+               append_tar_header(session, &st, 0, '5', NULL);
+          }
+     }
+
+     while (tar->depth > 0) {
+          if (sizeof(session->transfer_buffer) - session->transfer_len <
+              TAR_ENTRY_ROOM) {
+               return (ssize_t)session->transfer_len;
+          }
+          int level = tar->depth - 1;
+          int dir_fd = tar->dir_fds[level];
+          if (session->dirents_pos == session->dirents_len) {
+               long len = syscall(SYS_getdents64, dir_fd, session->dirents,
+                                  sizeof(session->dirents));
+               if (len < 0) return -1;
+               session->dirents_len = (size_t)len;
+               session->dirents_pos = 0;
+               if (len == 0) {
+                    // Done with this directory, back to its parent
+                    close(dir_fd);
+                    tar->depth--;
+                    continue;
+               }
+          }
+
+          struct dirent64 *entry =
+              (struct dirent64 *)(session->dirents + session->dirents_pos);
+          session->dirents_pos += entry->d_reclen;
+          const char *name = entry->d_name;
+          if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+              fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+               continue;
+          }
+          size_t base = tar->path_lens[level];
+          size_t len = strlen(name);
+          if (base + len + 2 > sizeof(tar->path)) {
+               log_warn("SITE TAR skips %s%s, the path is too long",
+                        tar->path, name);
+               continue;
+          }
+          memcpy(tar->path + base, name, len + 1);
+
+          if (S_ISDIR(st.st_mode)) {
+               if (tar->depth == TAR_MAX_DEPTH) {
+                    log_warn("SITE TAR skips %s, nested too deep", tar->path);
+                    continue;
+               }
+               int child = openat(dir_fd, name,
+                                  O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                      O_CLOEXEC);
+               if (child < 0) continue;
+               strcpy(tar->path + base + len, "/");
+               append_tar_header(session, &st, 0, '5', NULL);
+               // The parent goes on behind this entry once the child is done
+               lseek(dir_fd, (off_t)entry->d_off, SEEK_SET);
+               session->dirents_len = session->dirents_pos = 0;
+               tar->dir_fds[tar->depth] = child;
+               tar->path_lens[tar->depth] = base + len + 1;
+               tar->depth++;
+          } else if (S_ISREG(st.st_mode)) {
+               int file_fd = openat(dir_fd, name,
+                                    O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+               if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+                    if (file_fd >= 0) close(file_fd);
+                    continue;
+               }
+               append_tar_header(session, &st, st.st_size, '0', NULL);
+               session->file_fd = file_fd;
+               session->file_offset = 0;
+               session->file_end = st.st_size;
+               tar->padding = (TAR_BLOCK_SIZE - st.st_size % TAR_BLOCK_SIZE) %
+                              TAR_BLOCK_SIZE;
+               return (ssize_t)session->transfer_len;
+          } else if (S_ISLNK(st.st_mode)) {
+               char link[101];
+               ssize_t link_len = readlinkat(dir_fd, name, link, sizeof(link));
+               // Targets that do not fit the header are left out
+               if (link_len <= 0 || link_len == sizeof(link)) continue;
+               link[link_len] = '\0';
+               append_tar_header(session, &st, 0, '2', link);
+          }
+     }
+
+     // Two zero blocks end the archive
+     if (!tar->finished) {
+          if (sizeof(session->transfer_buffer) - session->transfer_len <
+              2 * TAR_BLOCK_SIZE) {
+               return (ssize_t)session->transfer_len;
+          }
+          tar->finished = true;
+          memset(session->transfer_buffer + session->transfer_len, 0,
+                 2 * TAR_BLOCK_SIZE);
+          session->transfer_len += 2 * TAR_BLOCK_SIZE;
+     }
+     return (ssize_t)session->transfer_len;
+}
+
+// SITE TAR: headers and padding go out from the transfer buffer, file
+// bodies with sendfile straight from the page cache
+void send_tar_chunks(Session *session, size_t budget) {
+     while (budget > 0) {
+          ssize_t sent;
+          if (session->transfer_sent < session->transfer_len) {
+               sent = send(session->data.fd,
+                           session->transfer_buffer + session->transfer_sent,
+                           session->transfer_len - session->transfer_sent,
+                           MSG_NOSIGNAL);
+               if (sent > 0) session->transfer_sent += (size_t)sent;
+          } else if (session->file_fd >= 0 &&
+                     session->file_offset < session->file_end) {
+               size_t max = budget < ZERO_COPY_CHUNK_SIZE
+                                ? budget
+                                : ZERO_COPY_CHUNK_SIZE;
+               if ((off_t)max > session->file_end - session->file_offset) {
+                    max = (size_t)(session->file_end - session->file_offset);
+               }
+               sent = session->send_method == SEND_SENDFILE
+                          ? send_with_sendfile(session, max)
+                          : send_with_buffer(session, max);
+               if (sent == 0) {
+                    // The header promised more, zeros make up the rest
+                    log_warn("File shrank while it was archived");
+                    session->tar->padding +=
+                        session->file_end - session->file_offset;
+                    session->file_offset = session->file_end;
+                    continue;
+               }
+               if (sent < 0 && session->send_method == SEND_SENDFILE &&
+                   (errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP)) {
+                    session->send_method = SEND_BUFFERED;
+                    continue;
+               }
+          } else {
+               if (session->file_fd >= 0) {
+                    close(session->file_fd);
+                    session->file_fd = -1;
+               }
+               ssize_t filled = fill_tar(session);
+               if (filled == 0) {
+                    log_debug("Archive finished, sent %lld bytes",
+                              (long long)session->bytes_transferred);
+                    finish_transfer(session, "226 Transfer complete.\r\n");
+                    return;
+               }
+               if (filled < 0) {
+                    log_warn("Error reading directory: %m");
+                    finish_transfer(session,
+                                    "451 Local error in processing.\r\n");
+                    return;
+               }
+               continue;
+          }
+
+          if (sent < 0) {
+               if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+               log_warn("Error sending archive: %m");
+               finish_transfer(session,
+                               "426 Connection closed; transfer aborted.\r\n");
+               return;
+          }
+          session->bytes_transferred += sent;
+          budget -= (size_t)sent < budget ? (size_t)sent : budget;
+     }
+}
+
+void handle_data_ready(Session *session) {
+     if (session->state == SESSION_SENDING &&
+         is_listing_command(session->transfer_command)) {
+          send_listing_chunks(session);
+     } else if (session->state == SESSION_SENDING ||
+                session->state == SESSION_RECEIVING) {
+          // A transfer over its limits sleeps until the scheduler wakes it
+          bool sending = session->state == SESSION_SENDING;
+          size_t budget = rate_budget(session, ZERO_COPY_BYTES_PER_EVENT);
+          set_interest(&session->data,
+                       budget == 0 ? 0 : sending ? EPOLLOUT : EPOLLIN);
+          off_t before = session->bytes_transferred;
+          if (budget > 0 && sending &&
+              session->transfer_command == CMD_SITE) {
+               send_tar_chunks(session, budget);
+          } else if (budget > 0 && sending) {
+               send_file_chunks(session, budget);
+          } else if (budget > 0) {
+               receive_file_chunks(session, budget);
+          }
+          rate_charge(session, (size_t)(session->bytes_transferred - before));
+     } else {
+          set_interest(&session->data, 0);
+     }
+     advance_session(session);
+}
+
+// Doubles the ring of a full queue. Keeps the old one if there is no
+// memory for the new one.
+bool queue_grow(WorkQueue *queue) {
+     size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+     Session **sessions = malloc(capacity * sizeof(Session *));
+     if (sessions == NULL) return false;
+     for (size_t i = 0; i < queue->count; i++) {
+          sessions[i] = queue->sessions[(queue->top + i) % queue->capacity];
+     }
+     free(queue->sessions);
+     queue->sessions = sessions;
+     queue->capacity = capacity;
+     queue->top = 0;
+     return true;
+}
+
+// The owner takes the most recently queued session first; a session queued
+// as last only runs once those before it have
+void queue_push(WorkQueue *queue, Session *session, bool last) {
+     pthread_mutex_lock(&queue->lock);
+     if (queue->count == queue->capacity && !queue_grow(queue)) {
+          session->next_overflow = queue->overflow;
+          queue->overflow = session;
+     } else if (last) {
+          queue->top = (queue->top + queue->capacity - 1) % queue->capacity;
+          queue->sessions[queue->top] = session;
+          queue->count++;
+     } else {
+          queue->sessions[(queue->top + queue->count) % queue->capacity] =
+              session;
+          queue->count++;
+     }
+     pthread_mutex_unlock(&queue->lock);
+
+     pthread_mutex_lock(&work_lock);
+     queued_sessions++;
+     pthread_cond_signal(&work_available);
+     pthread_mutex_unlock(&work_lock);
+}
+
+// Takes a session off the overflow list, once the ring is empty. Called
+// with the queue lock held.
+Session *queue_take_overflow(WorkQueue *queue) {
+     Session *session = queue->overflow;
+     if (session != NULL) queue->overflow = session->next_overflow;
+     return session;
+}
+
+// Owner side: most recently queued session first, its buffers are still hot
+Session *queue_pop(WorkQueue *queue) {
+     Session *session = NULL;
+     pthread_mutex_lock(&queue->lock);
+     if (queue->count > 0) {
+          queue->count--;
+          session =
+              queue->sessions[(queue->top + queue->count) % queue->capacity];
+     } else {
+          session = queue_take_overflow(queue);
+     }
+     pthread_mutex_unlock(&queue->lock);
+     return session;
+}
+
+// Thief side: oldest queued session first
+Session *queue_steal(WorkQueue *queue) {
+     Session *session = NULL;
+     pthread_mutex_lock(&queue->lock);
+     if (queue->count > 0) {
+          session = queue->sessions[queue->top];
+          queue->top = (queue->top + 1) % queue->capacity;
+          queue->count--;
+     } else {
+          session = queue_take_overflow(queue);
+     }
+     pthread_mutex_unlock(&queue->lock);
+     return session;
+}
+
+// Hands the session to a worker unless one already has it
+void schedule_session(Session *session, Worker *worker) {
+     if (atomic_exchange(&session->scheduled, true)) return;
+     if (worker == NULL) worker = &workers[session->home_worker];
+     queue_push(&worker->queue, session, false);
+}
+
+// Timer of the bandwidth scheduler, on the main thread. Hands what the
+// global limit earned since the last tick to the waiting transfers in
+// turn, RATE_QUANTUM times their weight each, and wakes those that may go.
+void rate_tick() {
+     uint64_t expirations;
+     if (read(rate_timer_fd, &expirations, sizeof(expirations)) < 0) return;
+
+     pthread_mutex_lock(&rate_lock);
+     uint64_t now = monotonic_ns();
+     bool limited = atomic_load(&rate_limited);
+     size_t global = refill(&global_tokens, &global_refilled, global_rate, now);
+     Session **link = &rate_waiters;
+     while (*link != NULL) {
+          Session *session = *link;
+          bool wake = !limited;
+          if (limited && rate_caps(session, now) >= RATE_MIN_GRANT) {
+               if (session->rate_credit > 0 || global_rate <= 0) {
+                    wake = true;
+               } else if (global >= RATE_MIN_GRANT) {
+                    // A turn may overdraw the bucket; the next turns wait
+                    // until it paid off, which keeps the shares by weight
+                    size_t grant = rate_quantum(session);
+                    session->rate_credit = grant;
+                    global_tokens -= (double)grant;
+                    global = global > grant ? global - grant : 0;
+                    wake = true;
+               }
+          }
+          if (!wake) {
+               link = &session->rate_next;
+               continue;
+          }
+          rate_unlink(link);
+          atomic_fetch_or(&session->data.ready, EPOLLIN | EPOLLOUT);
+          schedule_session(session, NULL);
+     }
+
+     if (rate_waiters == NULL) {
+          struct itimerspec stop = {{0, 0}, {0, 0}};
+          timerfd_settime(rate_timer_fd, 0, &stop, NULL);
+          rate_timer_armed = false;
+     }
+     pthread_mutex_unlock(&rate_lock);
+}
+
+Session *next_session(Worker *worker) {
+     while (1) {
+          Session *session = queue_pop(&worker->queue);
+          for (int i = 1; session == NULL && i < num_workers; i++) {
+               session =
+                   queue_steal(&workers[(worker->id + i) % num_workers].queue);
+          }
+
+          pthread_mutex_lock(&work_lock);
+          if (session != NULL) {
+               queued_sessions--;
+               pthread_mutex_unlock(&work_lock);
+               return session;
+          }
+          while (queued_sessions == 0) {
+               pthread_cond_wait(&work_available, &work_lock);
+          }
+          pthread_mutex_unlock(&work_lock);
+     }
+}
+
+// Handles every event reported for the session, then re-arms its
+// descriptors and gives it back to the event loop
+void run_session(Session *session, Worker *worker) {
+     uint32_t control, pasv, data, timer;
+     do {
+          control = atomic_exchange(&session->control.ready, 0);
+          pasv = atomic_exchange(&session->pasv.ready, 0);
+          data = atomic_exchange(&session->data.ready, 0);
+          timer = atomic_exchange(&session->data_timer.ready, 0);
+
+          if (data) handle_data_ready(session);
+          if (pasv && !session->closed) handle_pasv_ready(session);
+          if (timer && !session->closed) handle_data_timeout(session);
+          if (control && !session->closed) handle_client(session, control);
+          if (!control && !pasv && !data && !timer) {
+               if (session->state == SESSION_HASHING) {
+                    hash_file_chunks(session);
+               }
+               advance_session(session);
+          }
+     } while (!session->closed &&
+              (atomic_load(&session->control.ready) ||
+               atomic_load(&session->pasv.ready) ||
+               atomic_load(&session->data.ready) ||
+               atomic_load(&session->data_timer.ready)));
+
+     // A closed session stays marked as scheduled so it is never queued
+     // again, and is freed by the event loop once no event in flight can
+     // refer to it
+     if (session->closed) {
+          pthread_mutex_lock(&closed_lock);
+          session->next_closed = closed_sessions;
+          closed_sessions = session;
+          pthread_mutex_unlock(&closed_lock);
+          return;
+     }
+
+     arm_source(&session->control);
+     arm_source(&session->data);
+     arm_source(&session->data_timer);
+     // A digest being read waits for no event; the session stays scheduled
+     // and goes behind the others for its next pieces
+     if (session->state == SESSION_HASHING) {
+          queue_push(&worker->queue, session, true);
+          return;
+     }
+     atomic_store(&session->scheduled, false);
+
+     // Events may have arrived between the last check and the re-arm
+     if (atomic_load(&session->control.ready) ||
+         atomic_load(&session->pasv.ready) ||
+         atomic_load(&session->data.ready) ||
+         atomic_load(&session->data_timer.ready)) {
+          schedule_session(session, worker);
+     }
+}
+
+void *worker_main(void *arg) {
+     Worker *worker = arg;
+     if (io_backend == IO_BACKEND_URING) worker_ring = &worker->ring;
+     while (1) {
+          run_session(next_session(worker), worker);
+     }
+     return NULL;
+}
+
+// Quantiles, sum and count of a histogram in the text exposition format,
+// scaled from the recorded unit to the one in the metric name
+void render_summary(char *text, size_t size, size_t *len, const char *name,
+                    const char *labels, Histogram *histogram, double scale) {
+     static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+     const char *separator = labels[0] != '\0' ? "," : "";
+     char braced[BUFFER_SIZE / 8];
+     snprintf(braced, sizeof(braced), labels[0] != '\0' ? "{%s}" : "%s",
+              labels);
+     for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+          appendf(text, size, len, "%s{%s%squantile=\"%s\"} %.9g\n", name,
+                  labels, separator, quantiles[i],
+                  histogram_quantile(histogram, atof(quantiles[i])) * scale);
+     }
+     appendf(text, size, len, "%s_sum%s %.9g\n", name, braced,
+             atomic_load(&histogram->sum) * scale);
+     appendf(text, size, len, "%s_count%s %llu\n", name, braced,
+             (unsigned long long)atomic_load(&histogram->count));
+}
+
+// All metrics in the Prometheus text exposition format
+size_t render_metrics(char *text, size_t size) {
+     size_t len = 0;
+     char labels[64];
+
+     appendf(text, size, &len,
+             "# HELP ftp_sessions_active Open control connections.\n"
+             "# TYPE ftp_sessions_active gauge\n"
+             "ftp_sessions_active %ld\n"
+             "# HELP ftp_sessions_total Control connections accepted.\n"
+             "# TYPE ftp_sessions_total counter\n"
+             "ftp_sessions_total %llu\n"
+             "# HELP ftp_pasv_leases Passive ports leased by sessions.\n"
+             "# TYPE ftp_pasv_leases gauge\n"
+             "ftp_pasv_leases %ld\n",
+             atomic_load(&metrics.sessions_active),
+             (unsigned long long)atomic_load(&metrics.sessions_total),
+             atomic_load(&metrics.pasv_leases));
+
+     appendf(text, size, &len,
+             "# HELP ftp_commands_total Commands handled, by verb.\n"
+             "# TYPE ftp_commands_total counter\n");
+     for (int i = 0; i < NUM_COMMANDS; i++) {
+          appendf(text, size, &len, "ftp_commands_total{command=\"%s\"} %llu\n",
+                  commands[i].name,
+                  (unsigned long long)atomic_load(
+                      &metrics.command_latency[i].count));
+     }
+     appendf(text, size, &len,
+             "# HELP ftp_unknown_commands_total Command lines with an "
+             "unknown verb.\n"
+             "# TYPE ftp_unknown_commands_total counter\n"
+             "ftp_unknown_commands_total %llu\n",
+             (unsigned long long)atomic_load(&metrics.unknown_commands));
+
+     appendf(text, size, &len,
+             "# HELP ftp_command_duration_seconds Time from reading a command "
+             "to queueing its reply.\n"
+             "# TYPE ftp_command_duration_seconds summary\n");
+     for (int i = 0; i < NUM_COMMANDS; i++) {
+          if (atomic_load(&metrics.command_latency[i].count) == 0) continue;
+          snprintf(labels, sizeof(labels), "command=\"%s\"", commands[i].name);
+          render_summary(text, size, &len, "ftp_command_duration_seconds",
+                         labels, &metrics.command_latency[i], 1e-9);
+     }
+
+     appendf(text, size, &len,
+             "# HELP ftp_transfers_total Data transfers, by result.\n"
+             "# TYPE ftp_transfers_total counter\n"
+             "ftp_transfers_total{result=\"ok\"} %llu\n"
+             "ftp_transfers_total{result=\"failed\"} %llu\n"
+             "# HELP ftp_received_bytes_total Bytes uploaded.\n"
+             "# TYPE ftp_received_bytes_total counter\n"
+             "ftp_received_bytes_total %llu\n"
+             "# HELP ftp_sent_bytes_total Bytes of downloads and listings.\n"
+             "# TYPE ftp_sent_bytes_total counter\n"
+             "ftp_sent_bytes_total %llu\n",
+             (unsigned long long)atomic_load(&metrics.transfers_ok),
+             (unsigned long long)atomic_load(&metrics.transfers_failed),
+             (unsigned long long)atomic_load(&metrics.bytes_received),
+             (unsigned long long)atomic_load(&metrics.bytes_sent));
+     appendf(text, size, &len,
+             "# HELP ftp_transfer_duration_seconds Duration of completed "
+             "transfers.\n"
+             "# TYPE ftp_transfer_duration_seconds summary\n");
+     render_summary(text, size, &len, "ftp_transfer_duration_seconds", "",
+                    &metrics.transfer_duration, 1e-6);
+     appendf(text, size, &len,
+             "# HELP ftp_transfer_throughput_bytes_per_second Throughput of "
+             "completed transfers.\n"
+             "# TYPE ftp_transfer_throughput_bytes_per_second summary\n");
+     render_summary(text, size, &len,
+                    "ftp_transfer_throughput_bytes_per_second", "",
+                    &metrics.transfer_throughput, 1.0);
+
+     pthread_mutex_lock(&cache_lock);
+     size_t entries = cache_entries;
+     size_t bytes = cache_bytes;
+     pthread_mutex_unlock(&cache_lock);
+     appendf(text, size, &len,
+             "# HELP ftp_listing_cache_requests_total Listings served, by "
+             "whether they came from the cache.\n"
+             "# TYPE ftp_listing_cache_requests_total counter\n"
+             "ftp_listing_cache_requests_total{result=\"hit\"} %llu\n"
+             "ftp_listing_cache_requests_total{result=\"miss\"} %llu\n"
+             "# HELP ftp_listing_cache_entries Entries in the cache.\n"
+             "# TYPE ftp_listing_cache_entries gauge\n"
+             "ftp_listing_cache_entries %zu\n"
+             "# HELP ftp_listing_cache_bytes Memory held by the cache.\n"
+             "# TYPE ftp_listing_cache_bytes gauge\n"
+             "ftp_listing_cache_bytes %zu\n",
+             (unsigned long long)atomic_load(&metrics.cache_hits),
+             (unsigned long long)atomic_load(&metrics.cache_misses), entries,
+             bytes);
+
+     appendf(text, size, &len,
+             "# HELP ftp_logins_total Logins, by result.\n"
+             "# TYPE ftp_logins_total counter\n"
+             "ftp_logins_total{result=\"ok\"} %llu\n"
+             "ftp_logins_total{result=\"failed\"} %llu\n"
+             "# HELP ftp_auth_cache_hits_total Logins verified from the auth "
+             "cache instead of the password hash.\n"
+             "# TYPE ftp_auth_cache_hits_total counter\n"
+             "ftp_auth_cache_hits_total %llu\n",
+             (unsigned long long)atomic_load(&metrics.logins_ok),
+             (unsigned long long)atomic_load(&metrics.logins_failed),
+             (unsigned long long)atomic_load(&metrics.auth_cache_hits));
+
+     appendf(text, size, &len,
+             "# HELP ftp_digests_total Answers of HASH and XCRC, by whether "
+             "the digest was stored or the file read.\n"
+             "# TYPE ftp_digests_total counter\n"
+             "ftp_digests_total{source=\"stored\"} %llu\n"
+             "ftp_digests_total{source=\"computed\"} %llu\n",
+             (unsigned long long)atomic_load(&metrics.digests_stored),
+             (unsigned long long)atomic_load(&metrics.digests_computed));
+
+     pthread_mutex_lock(&file_cache_lock);
+     bytes = file_cache_bytes;
+     pthread_mutex_unlock(&file_cache_lock);
+     appendf(text, size, &len,
+             "# HELP ftp_file_cache_requests_total Downloads of files small "
+             "enough to cache, by whether they came from the cache.\n"
+             "# TYPE ftp_file_cache_requests_total counter\n"
+             "ftp_file_cache_requests_total{result=\"hit\"} %llu\n"
+             "ftp_file_cache_requests_total{result=\"miss\"} %llu\n"
+             "# HELP ftp_file_cache_evictions_total Files evicted to stay "
+             "within the size of the cache.\n"
+             "# TYPE ftp_file_cache_evictions_total counter\n"
+             "ftp_file_cache_evictions_total %llu\n"
+             "# HELP ftp_file_cache_bytes Memory held by the file cache.\n"
+             "# TYPE ftp_file_cache_bytes gauge\n"
+             "ftp_file_cache_bytes %zu\n",
+             (unsigned long long)atomic_load(&metrics.file_cache_hits),
+             (unsigned long long)atomic_load(&metrics.file_cache_misses),
+             (unsigned long long)atomic_load(&metrics.file_cache_evictions),
+             bytes);
+     return len;
+}
+
+// A client that sends an HTTP request gets an HTTP response, one that
+// sends nothing just the text
+void serve_metrics(int client) {
+     static char text[METRICS_TEXT_SIZE];
+     char request[BUFFER_SIZE];
+     bool http = false;
+     struct pollfd poll_fd = {.fd = client, .events = POLLIN};
+     if (poll(&poll_fd, 1, 100) > 0) {
+          ssize_t len = recv(client, request, sizeof(request), 0);
+          http = len >= 4 && memcmp(request, "GET ", 4) == 0;
+     }
+
+     size_t len = render_metrics(text, sizeof(text));
+     if (http) {
+          char header[BUFFER_SIZE];
+          int header_len = snprintf(
+              header, sizeof(header),
+              "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+              len);
+          send(client, header, (size_t)header_len, MSG_NOSIGNAL);
+     }
+     for (size_t sent = 0; sent < len;) {
+          ssize_t n = send(client, text + sent, len - sent, MSG_NOSIGNAL);
+          if (n < 0 && errno == EINTR) continue;
+          if (n <= 0) break;
+          sent += (size_t)n;
+     }
+}
+
+// Own thread, so a slow reader never holds up the event loop
+void *metrics_main(void *arg) {
+     int listener = (int)(intptr_t)arg;
+     struct timeval timeout = {.tv_sec = 1};
+     while (1) {
+          int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+          if (client < 0) {
+               if (errno != EINTR) log_warn("Metrics accept failed: %m");
+               continue;
+          }
+          setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                     sizeof(timeout));
+          serve_metrics(client);
+          close(client);
+     }
+     return NULL;
+}
+
+void start_metrics() {
+     if (metrics_socket_path[0] == '\0') return;
+
+     struct sockaddr_un addr = {.sun_family = AF_UNIX};
+     if (strlen(metrics_socket_path) >= sizeof(addr.sun_path)) {
+          log_error("Metrics socket path too long: %s", metrics_socket_path);
+          return;
+     }
+     strcpy(addr.sun_path, metrics_socket_path);
+
+     // A socket left by a previous run would make bind fail
+     unlink(metrics_socket_path);
+     int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     pthread_t thread;
+     if (listener < 0 ||
+         bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         chmod(metrics_socket_path, 0600) < 0 || listen(listener, 16) < 0 ||
+         pthread_create(&thread, NULL, metrics_main,
+                        (void *)(intptr_t)listener) != 0) {
+          log_error("Metrics socket disabled: %m");
+          if (listener >= 0) close(listener);
+          return;
+     }
+     pthread_detach(thread);
+     log_info("Metrics available on %s", metrics_socket_path);
+}
+
+bool start_workers() {
+     long cores = sysconf(_SC_NPROCESSORS_ONLN);
+     num_workers = cores > 0 ? (int)cores : 1;
+     // The processes of the pre-forked mode share the cores
+     if (process_index >= 0) {
+          num_workers = num_workers > num_processes
+                            ? num_workers / num_processes
+                            : 1;
+     }
+     workers = calloc((size_t)num_workers, sizeof(Worker));
+     if (workers == NULL) return false;
+
+     for (int i = 0; i < num_workers; i++) {
+          workers[i].id = i;
+          pthread_mutex_init(&workers[i].queue.lock, NULL);
+          workers[i].ring.fd = -1;
+     }
+
+     // Every worker gets its own ring; if any of them cannot be set up the
+     // whole server stays on the regular system calls
+     for (int i = 0; io_backend == IO_BACKEND_URING && i < num_workers; i++) {
+          if (!uring_setup(&workers[i].ring)) {
+               log_warn("io_uring unavailable, using regular system calls: %m");
+               io_backend = IO_BACKEND_SYSCALL;
+          }
+     }
+     for (int i = 0; i < num_workers; i++) {
+          if (pthread_create(&workers[i].thread, NULL, worker_main,
+                             &workers[i]) != 0) {
+               log_error("Failed to start worker thread: %m");
+               return false;
+          }
+     }
+
+     log_info("Started %d worker threads (%s)", num_workers,
+            io_backend == IO_BACKEND_URING ? "io_uring" : "system calls");
+     return true;
+}
+
+Session *create_session(int client_sock) {
+     Session *session = calloc(1, sizeof(Session));
+     if (session == NULL) return NULL;
+
+     session->control.kind = SOURCE_CONTROL;
+     session->control.fd = client_sock;
+     session->control.session = session;
+     session->pasv.kind = SOURCE_PASV;
+     session->pasv.fd = -1;
+     session->pasv.session = session;
+     session->pasv_accepted = -1;
+     session->data.kind = SOURCE_DATA;
+     session->data.fd = -1;
+     session->data.session = session;
+     session->data_timer.kind = SOURCE_DATA_TIMER;
+     session->data_timer.fd = -1;
+     session->data_timer.session = session;
+     session->file_fd = -1;
+     session->restart_end = -1;
+     session->file_end = -1;
+     session->pipe_fds[0] = -1;
+     session->pipe_fds[1] = -1;
+     session->state = SESSION_READING;
+     session->data_connection.data_socket = -1;
+     strncpy(session->current_dir, ROOT_DIR, BUFFER_SIZE);
+     session->dir_fd = openat(root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+     if (session->dir_fd < 0) {
+          free(session);
+          return NULL;
+     }
+     snprintf(session->dir_path, sizeof(session->dir_path), "%s", cache_root);
+
+     // PASV replies with the local address, and passive connections are
+     // matched to the session by the peer address
+     struct sockaddr_in addr;
+     socklen_t addr_len = sizeof(addr);
+     if (getsockname(client_sock, (struct sockaddr *)&addr, &addr_len) == 0) {
+          session->local_addr = addr.sin_addr;
+     }
+     addr_len = sizeof(addr);
+     if (getpeername(client_sock, (struct sockaddr *)&addr, &addr_len) == 0) {
+          session->peer_addr = addr.sin_addr;
+     }
+
+     //queue_reply(session, "220 FTP Server Ready\r\n");
+     queue_reply(session, "220 FTP Server Ready\nRun HELP for all available commands\n\nWARNING!\n--------\nFiles:\nServer must have a directory named server_data placed inside the same directory(it might not be created by the server automatically).\nClient must have a directory named data placed inside the same directory.\nUsers:\nA user is automatically logged in as anonymous, once they connect.\nUsers are: user1 (password1) / user2 (password2)\nAll users (even anonymous) are allowed in server_data/public and all its subdirectories\nOnce a user has logged in, they can access server_data/<username> as well as server_data/public.\nUsers are not allowed to go back to root (/server_data) once they have entered a subdirectory(/public || /<username>\r\n");
+     metrics_add(sessions_active, 1);
+     metrics_add(sessions_total, 1);
+     return session;
+}
+
+void accept_clients(int server_fd) {
+     struct sockaddr_in client_addr;
+     socklen_t addr_len;
+
+     while (1) {
+          addr_len = sizeof(client_addr);
+          int client_sock =
+              accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
+          if (client_sock < 0) {
+               if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    log_error("Accept failed: %m");
+               }
+               return;
+          }
+
+          char client_ip[INET_ADDRSTRLEN];
+          inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+          log_info("New client connected from %s:%d", client_ip,
+                 ntohs(client_addr.sin_port));
+
+          // Non-blocking first, so a failure has no session to undo
+          Session *session = set_nonblocking(client_sock) < 0
+                                 ? NULL
+                                 : create_session(client_sock);
+          if (session == NULL) {
+               log_error("Failed to set up client session: %m");
+               close(client_sock);
+               continue;
+          }
+          // Replies already go out in one write per batch of commands, and
+          // the 226 after a transfer must not wait for the client to
+          // acknowledge the 150 before it
+          int nodelay = 1;
+          setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                     sizeof(nodelay));
+          // Spread sessions over the workers; idle ones steal the rest
+          session->home_worker = client_sock % num_workers;
+          schedule_session(session, NULL);
+     }
+}
+
+// Hands each connection waiting on a passive port to the session of the
+// same client host that leased it. Connections nobody expects are closed, so
+// no other host can take over a transfer.
+void accept_pasv_connections(PasvPort *port) {
+     struct sockaddr_in peer_addr;
+     socklen_t addr_len;
+
+     while (1) {
+          addr_len = sizeof(peer_addr);
+          int data_sock =
+              accept4(port->source.fd, (struct sockaddr *)&peer_addr,
+                      &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (data_sock < 0) {
+               if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    log_warn("Failed to accept data connection on port %u: %m",
+                             port->port);
+               }
+               return;
+          }
+
+          pthread_mutex_lock(&pasv_lock);
+          Session *session = port->lessees;
+          while (session != NULL &&
+                 session->peer_addr.s_addr != peer_addr.sin_addr.s_addr) {
+               session = session->next_lessee;
+          }
+          // One connection per lease waits for the transfer
+          int expected = -1;
+          bool handed_over =
+              session != NULL &&
+              atomic_compare_exchange_strong(&session->pasv_accepted,
+                                             &expected, data_sock);
+          pthread_mutex_unlock(&pasv_lock);
+
+          if (!handed_over) {
+               char peer_ip[INET_ADDRSTRLEN];
+               inet_ntop(AF_INET, &peer_addr.sin_addr, peer_ip,
+                         sizeof(peer_ip));
+               log_warn("Refused unexpected data connection from %s on port "
+                        "%u",
+                        peer_ip, port->port);
+               close(data_sock);
+               continue;
+          }
+          // Sessions are only freed by this thread, so the lessee is still
+          // there even if it has given the port back in the meantime
+          atomic_fetch_or(&session->pasv.ready, EPOLLIN);
+          schedule_session(session, NULL);
+     }
+}
+
+// Opens a listener on every port of the passive range; ports that are taken
+// are left out
+void open_pasv_ports() {
+     struct rlimit limit;
+     if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+         limit.rlim_cur != RLIM_INFINITY &&
+         limit.rlim_cur / PASV_PORT_FD_SHARE <
+             (rlim_t)(pasv_port_max - pasv_port_min + 1)) {
+          int count = (int)(limit.rlim_cur / PASV_PORT_FD_SHARE);
+          if (count < 1) count = 1;
+          log_warn("The descriptor limit of %llu only leaves room for %d "
+                   "passive ports, serving %d to %d",
+                   (unsigned long long)limit.rlim_cur, count, pasv_port_min,
+                   pasv_port_min + count - 1);
+          pasv_port_max = pasv_port_min + count - 1;
+     }
+
+     pasv_ports = calloc((size_t)(pasv_port_max - pasv_port_min + 1),
+                         sizeof(PasvPort));
+     if (pasv_ports == NULL) return;
+
+     for (int port = pasv_port_min; port <= pasv_port_max; port++) {
+          int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+          int reuse = 1;
+          struct sockaddr_in addr = {.sin_family = AF_INET,
+                                     .sin_addr.s_addr = INADDR_ANY,
+                                     .sin_port = htons((uint16_t)port)};
+          if (fd < 0 ||
+              setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                         sizeof(reuse)) < 0 ||
+              bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+              listen(fd, SOMAXCONN) < 0) {
+               log_warn("Cannot listen on passive port %d: %m", port);
+               if (fd >= 0) close(fd);
+               continue;
+          }
+
+          PasvPort *pasv_port = &pasv_ports[pasv_port_count];
+          pasv_port->source.kind = SOURCE_PASV_PORT;
+          pasv_port->source.fd = fd;
+          pasv_port->port = (uint16_t)port;
+          struct epoll_event event = {.events = EPOLLIN,
+                                      .data.ptr = &pasv_port->source};
+          if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+               log_warn("Cannot watch passive port %d: %m", port);
+               close(fd);
+               continue;
+          }
+          pasv_port_count++;
+     }
+     log_info("Listening on %d passive ports from %d to %d", pasv_port_count,
+              pasv_port_min, pasv_port_max);
+}
+
+void ftp_server() {
+     int server_fd;
+     struct sockaddr_in server_addr;
+
+     // Peers closing a data or control connection must not kill the server
+     signal(SIGPIPE, SIG_IGN);
+
+     server_fd = socket(AF_INET, SOCK_STREAM, 0);
+     if (server_fd < 0) {
+          log_error("Socket creation failed: %m");
+          return;
+     }
+
+     // Sessions closed by the server leave TIME_WAIT entries on the control
+     // port, which must not keep a restarted server from binding it
+     int reuse = 1;
+     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+     // In the pre-forked mode every process binds the port on its own and
+     // the kernel spreads the new connections over their listeners
+     if (process_index >= 0 &&
+         setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                    sizeof(reuse)) < 0) {
+          log_error("SO_REUSEPORT failed: %m");
+          close(server_fd);
+          return;
+     }
+
+     server_addr.sin_family = AF_INET;
+     server_addr.sin_addr.s_addr = INADDR_ANY;
+     server_addr.sin_port = htons(FTP_PORT);
+     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
+         0) {
+          log_error("Bind failed: %m");
+          close(server_fd);
+          return;
+     }
+
+     if (listen(server_fd, SOMAXCONN) < 0 || set_nonblocking(server_fd) < 0) {
+          log_error("Listen failed: %m");
+          return;
+     }
+
+     root_fd = open(ROOT_DIR + 1, O_PATH | O_DIRECTORY | O_CLOEXEC);
+     if (root_fd < 0) {
+          log_error("Cannot open the server_data directory: %m");
+          close(server_fd);
+          return;
+     }
+
+     epoll_fd = epoll_create1(0);
+     if (epoll_fd < 0) {
+          log_error("epoll_create1 failed: %m");
+          close(server_fd);
+          return;
+     }
+
+     if (!start_workers()) {
+          close(epoll_fd);
+          close(server_fd);
+          return;
+     }
+
+     // The listener stays level-triggered and is only served by this thread
+     EventSource listener = {.kind = SOURCE_LISTENER, .fd = server_fd};
+     struct epoll_event listen_event = {.events = EPOLLIN,
+                                        .data.ptr = &listener};
+     epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &listen_event);
+
+     // So does the inotify descriptor of the metadata cache
+     cache_init();
+     EventSource cache_events = {.kind = SOURCE_INOTIFY, .fd = inotify_fd};
+     struct epoll_event inotify_event = {.events = EPOLLIN,
+                                         .data.ptr = &cache_events};
+     if (inotify_fd >= 0) {
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &inotify_event);
+     }
+
+     open_pasv_ports();
+     // The scheduler timer only ticks while transfers wait for bandwidth
+     rate_timer_fd =
+         timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+     EventSource rate_timer = {.kind = SOURCE_RATE_TIMER, .fd = rate_timer_fd};
+     struct epoll_event timer_event = {.events = EPOLLIN,
+                                       .data.ptr = &rate_timer};
+     if (rate_timer_fd < 0 ||
+         epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rate_timer_fd, &timer_event) < 0) {
+          log_error("Cannot create the bandwidth scheduler timer: %m");
+          close(epoll_fd);
+          close(server_fd);
+          return;
+     }
+     // SIGHUP, blocked in every thread, rereads the user database
+     sigset_t reload;
+     sigemptyset(&reload);
+     sigaddset(&reload, SIGHUP);
+     int signal_fd = signalfd(-1, &reload, SFD_NONBLOCK | SFD_CLOEXEC);
+     EventSource signals = {.kind = SOURCE_SIGNAL, .fd = signal_fd};
+     struct epoll_event signal_event = {.events = EPOLLIN,
+                                        .data.ptr = &signals};
+     if (signal_fd < 0 ||
+         epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &signal_event) < 0) {
+          log_warn("SIGHUP will not reload the user database: %m");
+     }
+     load_user_db();
+     start_metrics();
+     log_info("FTP Server started on port %d...", FTP_PORT);
+
+     struct epoll_event events[MAX_EVENTS];
+     while (1) {
+          pthread_mutex_lock(&closed_lock);
+          Session *closed = closed_sessions;
+          closed_sessions = NULL;
+          pthread_mutex_unlock(&closed_lock);
+          while (closed != NULL) {
+               Session *session = closed;
+               closed = session->next_closed;
+               free(session);
+          }
+
+          int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+          if (ready < 0) {
+               if (errno == EINTR) continue;
+               log_error("epoll_wait failed: %m");
+               break;
+          }
+
+          for (int i = 0; i < ready; i++) {
+               EventSource *source = events[i].data.ptr;
+               if (source->kind == SOURCE_LISTENER) {
+                    accept_clients(server_fd);
+                    continue;
+               }
+               if (source->kind == SOURCE_INOTIFY) {
+                    handle_cache_events();
+                    continue;
+               }
+               if (source->kind == SOURCE_PASV_PORT) {
+                    accept_pasv_connections((PasvPort *)source);
+                    continue;
+               }
+               if (source->kind == SOURCE_RATE_TIMER) {
+                    rate_tick();
+                    continue;
+               }
+               if (source->kind == SOURCE_SIGNAL) {
+                    struct signalfd_siginfo info;
+                    while (read(signal_fd, &info, sizeof(info)) > 0) {
+                         load_user_db();
+                    }
+                    continue;
+               }
+
+               // The descriptor stays disarmed until a worker has run
+               // the session
+               atomic_fetch_or(&source->ready, events[i].events);
+               schedule_session(source->session, NULL);
+          }
+     }
+
+     close(epoll_fd);
+     close(server_fd);
+}
+
+// Runs in a freshly forked process of the pre-forked mode. It takes its
+// own share of the passive ports, so a data connection always reaches the
+// process that sent PASV, and its own metrics socket.
+__attribute__((noreturn)) void run_worker_process(int index,
+                                                  pid_t supervisor) {
+     process_index = index;
+     // Goes down with the supervisor, even if that was killed outright
+     prctl(PR_SET_PDEATHSIG, SIGTERM);
+     if (getppid() != supervisor) _exit(EXIT_FAILURE);
+
+     int span = (pasv_port_max - pasv_port_min + 1) / num_processes;
+     pasv_port_min += index * span;
+     pasv_port_max = pasv_port_min + span - 1;
+
+     static char metrics_path[PATH_MAX];
+     if (metrics_socket_path[0] != '\0') {
+          snprintf(metrics_path, sizeof(metrics_path), "%s.%d",
+                   metrics_socket_path, index);
+          metrics_socket_path = metrics_path;
+     }
+
+     // Only SIGHUP stays blocked, for the signalfd of the event loop
+     sigset_t signals;
+     sigemptyset(&signals);
+     sigaddset(&signals, SIGHUP);
+     pthread_sigmask(SIG_SETMASK, &signals, NULL);
+     log_start();
+     ftp_server();
+     log_drain();
+     _exit(EXIT_FAILURE);
+}
+
+pid_t spawn_worker_process(int index, pid_t supervisor) {
+     // Lines still in the rings would be printed by the child too
+     log_drain();
+     pid_t pid = fork();
+     if (pid == 0) run_worker_process(index, supervisor);
+     if (pid < 0) {
+          log_error("Cannot start worker process %d: %m", index);
+     } else {
+          log_info("Started worker process %d (pid %d)", index, (int)pid);
+     }
+     return pid;
+}
+
+// The supervisor of the pre-forked mode: starts the worker processes and
+// starts a worker again when it dies, so a crash only drops the sessions
+// of one process. SIGHUP is passed on to the workers, SIGINT and SIGTERM
+// stop them. It has no threads; what it logs is drained right here.
+int supervise_workers() {
+     pid_t *pids = calloc((size_t)num_processes, sizeof(pid_t));
+     uint64_t *started = calloc((size_t)num_processes, sizeof(uint64_t));
+     if (pids == NULL || started == NULL) {
+          perror("Cannot start the supervisor");
+          return EXIT_FAILURE;
+     }
+
+     sigset_t signals;
+     sigemptyset(&signals);
+     sigaddset(&signals, SIGCHLD);
+     sigaddset(&signals, SIGHUP);
+     sigaddset(&signals, SIGINT);
+     sigaddset(&signals, SIGTERM);
+     sigprocmask(SIG_BLOCK, &signals, NULL);
+
+     pid_t supervisor = getpid();
+     for (int i = 0; i < num_processes; i++) {
+          pids[i] = spawn_worker_process(i, supervisor);
+          started[i] = monotonic_ns();
+     }
+
+     while (1) {
+          log_drain();
+          int signal_number = sigwaitinfo(&signals, NULL);
+          if (signal_number == SIGHUP) {
+               for (int i = 0; i < num_processes; i++) {
+                    if (pids[i] > 0) kill(pids[i], SIGHUP);
+               }
+               continue;
+          }
+          if (signal_number == SIGINT || signal_number == SIGTERM) {
+               break;
+          }
+          if (signal_number != SIGCHLD) continue;
+
+          int status;
+          pid_t pid;
+          while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+               int i = 0;
+               while (i < num_processes && pids[i] != pid) i++;
+               if (i == num_processes) continue;
+               if (WIFSIGNALED(status)) {
+                    log_error("Worker process %d (pid %d) killed by signal "
+                              "%d",
+                              i, (int)pid, WTERMSIG(status));
+               } else {
+                    log_error("Worker process %d (pid %d) exited with "
+                              "status %d",
+                              i, (int)pid, WEXITSTATUS(status));
+               }
+               // One that cannot even start, e.g. without server_data,
+               // is started again at most once a second
+               if (monotonic_ns() - started[i] < WORKER_RESPAWN_DELAY_NS) {
+                    log_drain();
+                    struct timespec delay = {
+                        WORKER_RESPAWN_DELAY_NS / 1000000000ULL, 0};
+                    nanosleep(&delay, NULL);
+               }
+               pids[i] = spawn_worker_process(i, supervisor);
+               started[i] = monotonic_ns();
+          }
+     }
+
+     log_info("Stopping the worker processes");
+     for (int i = 0; i < num_processes; i++) {
+          if (pids[i] > 0) kill(pids[i], SIGTERM);
+     }
+     for (int i = 0; i < num_processes; i++) {
+          if (pids[i] > 0) waitpid(pids[i], NULL, 0);
+     }
+     log_drain();
+     free(pids);
+     free(started);
+     return EXIT_SUCCESS;
+}
+
+// microbench.c runs the functions above on their own
+#ifndef FTP_SERVER_NO_MAIN
+int main(int argc, char *argv[]) {
+     for (int i = 1; i < argc; i++) {
+          if (strcmp(argv[i], "--io-uring") == 0) {
+               io_backend = IO_BACKEND_URING;
+          } else if (strcmp(argv[i], "--metrics-socket") == 0 &&
+                     i + 1 < argc) {
+               metrics_socket_path = argv[++i];
+          } else if (strcmp(argv[i], "--pasv-ports") == 0 && i + 1 < argc &&
+                     sscanf(argv[++i], "%d-%d", &pasv_port_min,
+                            &pasv_port_max) == 2 &&
+                     pasv_port_min > 0 && pasv_port_min <= pasv_port_max &&
+                     pasv_port_max <= 65535) {
+               continue;
+          } else if (strcmp(argv[i], "--processes") == 0 && i + 1 < argc &&
+                     sscanf(argv[++i], "%d", &num_processes) == 1 &&
+                     num_processes >= 0 && num_processes <= MAX_PROCESSES) {
+               continue;
+          } else if (strcmp(argv[i], "--admin") == 0 && i + 1 < argc) {
+               admin_user = argv[++i];
+          } else if (strcmp(argv[i], "--file-cache") == 0 && i + 1 < argc &&
+                     parse_bytes(argv[i + 1]) >= 0) {
+               file_cache_limit = (size_t)parse_bytes(argv[++i]);
+          } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+               users_file = argv[++i];
+          } else if (strcmp(argv[i], "--hash-password") == 0 &&
+                     i + 1 < argc) {
+               return print_user_line(argv[i + 1]) ? EXIT_SUCCESS
+                                                   : EXIT_FAILURE;
+          } else {
+               fprintf(stderr,
+                       "Usage: %s [--io-uring] [--metrics-socket PATH] "
+                       "[--pasv-ports LOW-HIGH] [--admin USER] "
+                       "[--file-cache SIZE] [--users PATH] "
+                       "[--processes N]\n"
+                       "       %s --hash-password USER < password\n",
+                       argv[0], argv[0]);
+               return EXIT_FAILURE;
+          }
+     }
+
+     // --processes 0 runs one process per core
+     if (num_processes == 0) {
+          long cores = sysconf(_SC_NPROCESSORS_ONLN);
+          num_processes = cores > 0 ? (int)cores : 1;
+     }
+     if (num_processes > pasv_port_max - pasv_port_min + 1) {
+          fprintf(stderr, "Every process needs a passive port of its own\n");
+          return EXIT_FAILURE;
+     }
+     // Every session holds several descriptors; the copies of --processes
+     // inherit the limit
+     struct rlimit limit;
+     if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+          limit.rlim_cur = limit.rlim_max;
+          setrlimit(RLIMIT_NOFILE, &limit);
+     }
+     if (num_processes > 1) return supervise_workers();
+
+     // Blocked before any thread starts, so only the event loop sees it
+     sigset_t reload;
+     sigemptyset(&reload);
+     sigaddset(&reload, SIGHUP);
+     pthread_sigmask(SIG_BLOCK, &reload, NULL);
+     log_start();
+     ftp_server();
+     // Only returns when the server could not start or the event loop
+     // failed; the reason must not stay in the rings
+     log_drain();
+     return EXIT_FAILURE;
 }
+#endif